@@ -5,77 +5,870 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 using namespace std;
 
 #include "disk.h"
 
+// A disk is one file, or a set of member files the blocks are striped
+// across. Each member holds its share of the blocks, followed by a checksum
+// region: a header block whose first word is SUM_MAGIC while the checksums
+// are valid, then one CRC32C per block the member holds. A block's checksum
+// is written right after the block, in the same member request, so a write
+// cut short by a crash shows up as a mismatch. A disk without valid
+// checksums (new, or last used with NO_CHECKSUMS) has them rebuilt from the
+// blocks when it is mounted, and is reported as unverified.
+//
+// The first member also keeps a map of the blocks written since the last
+// checkpoint, after its checksum region: a header block holding CHANGE_MAGIC
+// and the checkpoint generation, then one bit per block. It is written
+// back at unmount like the checksums; a disk that was not unmounted cleanly
+// has every block marked changed.
+//
+// The members of a striped disk start with a label block recording the
+// layout, so the set is always put back together the same way.
+//
+// While a trace is being recorded, every request is logged as it arrives,
+// before the cache is looked at, so replaying the trace (see replay.cpp)
+// puts the same load on whatever disk and cache it is replayed against.
+const unsigned int SUM_MAGIC = 0x43524343;
+const unsigned int CHANGE_MAGIC = 0x43484e47;
+const unsigned int STRIPE_MAGIC = 0x53545250;
+const int MAX_DISKS = 4;
+const int PARALLEL_BLOCKS = 128;	// smallest request split across workers
+
+struct label_t {
+  unsigned int magic;		// must be STRIPE_MAGIC
+  unsigned int set_id;		// same for every member of a set
+  int member;			// position of this member in the set
+  int num_members;		// number of members in the set
+  int stripe_unit;		// consecutive blocks kept on one member
+};
+
+struct change_header_t {
+  unsigned int magic;		// CHANGE_MAGIC while the map is valid
+  unsigned int generation;	// checkpoint the map is relative to
+};
+
+struct member_t {
+  int fd;			// file descriptor of the member file
+  off_t data_offset;		// where the member's first block starts
+  int num_blocks;		// number of blocks the member holds
+};
+
+struct member_io_t;
+
+struct disk_t {
+  bool mounted;			// set while the descriptor is in use
+  int num_members;		// number of member files
+  int stripe_unit;		// consecutive blocks kept on one member
+  member_t members[MAX_MEMBERS];
+  char (*cache_blocks)[BLOCK_SIZE]; // cached block contents (NULL - no cache)
+  bool cache_valid[NUM_BLOCKS];	// set if block is in the cache
+  bool summed;			// set if blocks are checksummed
+  unsigned int sums[NUM_BLOCKS];	// checksum of every block
+  unsigned int generation;	// last checkpoint
+  unsigned char changed[NUM_BLOCKS / 8]; // blocks written since then
+
+  // Workers serving the members of a striped disk, one per member. They
+  // are started when the disk is mounted and stopped when it is unmounted.
+  thread workers[MAX_MEMBERS];
+  mutex io_lock;		// guards the fields below
+  condition_variable io_ready;	// signalled when parts are handed out
+  condition_variable io_done;	// signalled when the last part is done
+  member_io_t *io_parts[MAX_MEMBERS]; // part each worker is to move
+  bool io_writing;		// set if the parts are to be written
+  int io_pending;		// parts handed out and not yet done
+  bool io_stop;			// set to stop the workers
+};
+
+// One member's part of a request
+struct member_io_t {
+  off_t offset;			// where the part starts in the member
+  vector<struct iovec> iov;	// pieces of the caller's buffer, in order
+  size_t len;			// total bytes
+  off_t sum_offset;		// where the part's checksums go (writes)
+  vector<unsigned int> sums;	// checksums of the blocks written
+  bool ok;			// set if the whole part was transferred
+};
+
+static disk_t disks[MAX_DISKS];			// mounted disks by descriptor
+static int trace_fd = -1;			// trace being recorded (-1 if none)
+static vector<char> trace_buf;			// records not yet written out
+static struct timespec trace_last;		// time of the last record
+static unsigned int crc_table[256];		// table for the software CRC
+static unsigned int (*crc32c)(const void *, size_t); // CRC used for blocks
+
+// Table driven CRC32C (Castagnoli, reflected polynomial 0x82F63B78)
+static unsigned int crc32c_table(const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  unsigned int crc = 0xFFFFFFFF;
+
+  while (len--)
+    crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+// CRC32C using the SSE4.2 crc32 instruction, 8 bytes at a time
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_hw(const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  unsigned int crc = 0xFFFFFFFF;
+
+#if defined(__x86_64__)
+  unsigned long long crc64 = crc;
+  for (; len >= 8; len -= 8, p += 8) {
+    unsigned long long word;
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (unsigned int) crc64;
+#endif
+  for (; len >= 4; len -= 4, p += 4) {
+    unsigned int word;
+    memcpy(&word, p, 4);
+    crc = _mm_crc32_u32(crc, word);
+  }
+  while (len--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return ~crc;
+}
+
+static bool crc32c_hw_supported()
+{
+  return __builtin_cpu_supports("sse4.2");
+}
+
+// CRC32C using the ARMv8 crc32c instructions, 8 bytes at a time
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static unsigned int crc32c_hw(const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  unsigned int crc = 0xFFFFFFFF;
+
+  for (; len >= 8; len -= 8, p += 8) {
+    unsigned long long word;
+    memcpy(&word, p, 8);
+    crc = __crc32cd(crc, word);
+  }
+  while (len--)
+    crc = __crc32cb(crc, *p++);
+  return ~crc;
+}
+
+static bool crc32c_hw_supported()
+{
+  return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+// Picks the CRC32C implementation the first time one is needed
+static void init_crc32c()
+{
+  if (crc32c != NULL) return;
+
+  for (unsigned int i = 0; i < 256; i++) {
+    unsigned int crc = i;
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+    crc_table[i] = crc;
+  }
+
+  crc32c = crc32c_table;
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+  if (crc32c_hw_supported())
+    crc32c = crc32c_hw;
+#endif
+}
+
+
+// Returns the mounted disk for a descriptor
+static disk_t &get_disk(int fd)
+{
+  if (fd < 0 || fd >= MAX_DISKS || !disks[fd].mounted) {
+    cerr << "Invalid disk descriptor" << endl;
+    exit(-1);
+  }
+  return disks[fd];
+}
+
+// Finds the member holding a block and the block's place in that member
+static void map_block(const disk_t &d, int block_num, int *member, int *local)
+{
+  int unit = block_num / d.stripe_unit;
+
+  *member = unit % d.num_members;
+  *local = (unit / d.num_members) * d.stripe_unit + block_num % d.stripe_unit;
+}
+
+// Moves one member's part of a request with a single call, then writes
+// the checksums of the blocks written
+static void member_io(int fd, bool writing, member_io_t *io)
+{
+  ssize_t size;
+
+  if (writing)
+    size = pwritev(fd, &io->iov[0], io->iov.size(), io->offset);
+  else
+    size = preadv(fd, &io->iov[0], io->iov.size(), io->offset);
+  io->ok = (size == (ssize_t) io->len);
+
+  if (io->ok && !io->sums.empty()) {
+    size_t len = io->sums.size() * sizeof(unsigned int);
+    io->ok = pwrite(fd, &io->sums[0], len, io->sum_offset) == (ssize_t) len;
+  }
+}
+
+// Moves the parts handed to a member's worker until the disk is unmounted
+static void member_worker(disk_t *d, int member)
+{
+  unique_lock<mutex> lock(d->io_lock);
+
+  while (true) {
+    while (!d->io_stop && d->io_parts[member] == NULL)
+      d->io_ready.wait(lock);
+    if (d->io_parts[member] == NULL) return;
+
+    member_io_t *io = d->io_parts[member];
+    bool writing = d->io_writing;
+    lock.unlock();
+    member_io(d->members[member].fd, writing, io);
+    lock.lock();
+
+    d->io_parts[member] = NULL;
+    if (--d->io_pending == 0)
+      d->io_done.notify_one();
+  }
+}
+
+// Starts a worker for every member of a striped disk
+static void start_workers(disk_t &d)
+{
+  d.io_stop = false;
+  d.io_pending = 0;
+  for (int m = 0; m < d.num_members; m++)
+    d.io_parts[m] = NULL;
+  for (int m = 0; m < d.num_members; m++)
+    d.workers[m] = thread(member_worker, &d, m);
+}
+
+// Stops the workers of a disk
+static void stop_workers(disk_t &d)
+{
+  {
+    lock_guard<mutex> guard(d.io_lock);
+    d.io_stop = true;
+  }
+  d.io_ready.notify_all();
+  for (int m = 0; m < d.num_members; m++)
+    if (d.workers[m].joinable())
+      d.workers[m].join();
+}
+
+// Reads or writes count consecutive blocks. The request is split by
+// member; a member's blocks within a run of logical blocks are always
+// consecutive in the member, so each member gets one call. The caller
+// moves the first part itself. In a request of PARALLEL_BLOCKS or more the
+// other parts are handed to the member workers and moved in parallel;
+// smaller ones cost less to move in turn than to hand over. Returns false if any part came up short.
+static bool disk_io(disk_t &d, bool writing, int block_num, int count, char *buf)
+{
+  member_io_t ios[MAX_MEMBERS];
+  int first = -1;
+  int handed = 0;
+  bool ok = true;
+
+  for (int b = block_num; b < block_num + count; ) {
+    int member;
+    int local;
+    int len = d.stripe_unit - b % d.stripe_unit;
+    struct iovec piece;
+
+    if (len > block_num + count - b) len = block_num + count - b;
+    map_block(d, b, &member, &local);
+
+    member_io_t &io = ios[member];
+    const member_t &mem = d.members[member];
+    if (io.iov.empty()) {
+      io.offset = mem.data_offset + (off_t) local * BLOCK_SIZE;
+      io.len = 0;
+      io.sum_offset = mem.data_offset + (off_t) (mem.num_blocks + 1) * BLOCK_SIZE +
+        (off_t) local * sizeof(unsigned int);
+    }
+    if (writing && d.summed)
+      io.sums.insert(io.sums.end(), d.sums + b, d.sums + b + len);
+    piece.iov_base = buf + (size_t) (b - block_num) * BLOCK_SIZE;
+    piece.iov_len = (size_t) len * BLOCK_SIZE;
+    io.iov.push_back(piece);
+    io.len += piece.iov_len;
+    b += len;
+  }
+
+  for (int m = 0; m < d.num_members; m++) {
+    if (ios[m].iov.empty()) continue;
+    if (first == -1) {
+      first = m;
+      continue;
+    }
+    if (count < PARALLEL_BLOCKS) {
+      member_io(d.members[m].fd, writing, &ios[m]);
+      continue;
+    }
+    if (handed == 0)
+      d.io_lock.lock();
+    d.io_parts[m] = &ios[m];
+    handed++;
+  }
+  if (handed > 0) {
+    d.io_writing = writing;
+    d.io_pending = handed;
+    d.io_lock.unlock();
+    d.io_ready.notify_all();
+  }
+
+  if (first != -1)
+    member_io(d.members[first].fd, writing, &ios[first]);
+
+  if (handed > 0) {
+    unique_lock<mutex> lock(d.io_lock);
+    while (d.io_pending > 0)
+      d.io_done.wait(lock);
+  }
+
+  for (int m = 0; m < d.num_members; m++)
+    if (!ios[m].iov.empty() && !ios[m].ok)
+      ok = false;
+  return ok;
+}
+
+// Writes the first word of a member's checksum region
+static void write_sum_header(const member_t &m, unsigned int magic)
+{
+  off_t offset = m.data_offset + (off_t) m.num_blocks * BLOCK_SIZE;
+
+  if (pwrite(m.fd, &magic, sizeof(magic), offset) != sizeof(magic)) {
+    cerr << "Failed to write checksum header" << endl;
+    exit(-1);
+  }
+}
+
+// Writes every checksum out and marks them valid
+static void save_sums(disk_t &d)
+{
+  vector<unsigned int> local_sums;
+
+  for (int m = 0; m < d.num_members; m++) {
+    const member_t &mem = d.members[m];
+    off_t offset = mem.data_offset + (off_t) (mem.num_blocks + 1) * BLOCK_SIZE;
+    size_t len = mem.num_blocks * sizeof(unsigned int);
+
+    local_sums.resize(mem.num_blocks);
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+      int member;
+      int local;
+      map_block(d, b, &member, &local);
+      if (member == m) local_sums[local] = d.sums[b];
+    }
+    if (pwrite(mem.fd, &local_sums[0], len, offset) != (ssize_t) len) {
+      cerr << "Failed to write block checksums" << endl;
+      exit(-1);
+    }
+    write_sum_header(mem, SUM_MAGIC);
+  }
+}
+
+// Loads the checksums of a disk that was just opened. If any member lacks
+// a valid checksum region (new, or last written with NO_CHECKSUMS) every
+// block is checksummed again and the checksums are written out; the
+// blocks of a disk that is not new are reported as unverified. Built with
+// NO_CHECKSUMS, the regions are only marked invalid, since the blocks are
+// about to change without them.
+static void load_sums(disk_t &d, bool new_disk)
+{
+  bool valid = !new_disk;
+
+#ifdef NO_CHECKSUMS
+  if (!new_disk)
+    for (int m = 0; m < d.num_members; m++)
+      write_sum_header(d.members[m], 0);
+  return;
+#endif
+
+  init_crc32c();
+  d.summed = true;
+
+  for (int m = 0; m < d.num_members && valid; m++) {
+    const member_t &mem = d.members[m];
+    off_t offset = mem.data_offset + (off_t) mem.num_blocks * BLOCK_SIZE;
+    unsigned int magic = 0;
+
+    valid = pread(mem.fd, &magic, sizeof(magic), offset) == sizeof(magic) &&
+      magic == SUM_MAGIC;
+  }
+
+  if (valid) {
+    vector<unsigned int> local_sums;
+    for (int m = 0; m < d.num_members; m++) {
+      const member_t &mem = d.members[m];
+      off_t offset = mem.data_offset + (off_t) (mem.num_blocks + 1) * BLOCK_SIZE;
+      size_t len = mem.num_blocks * sizeof(unsigned int);
+
+      local_sums.resize(mem.num_blocks);
+      if (pread(mem.fd, &local_sums[0], len, offset) != (ssize_t) len) {
+        cerr << "Failed to read block checksums" << endl;
+        exit(-1);
+      }
+      for (int b = 0; b < NUM_BLOCKS; b++) {
+        int member;
+        int local;
+        map_block(d, b, &member, &local);
+        if (member == m) d.sums[b] = local_sums[local];
+      }
+    }
+  }
+  else {
+    // Checksum whatever the disk holds now. A new disk is empty, and every
+    // block is checksummed as it is formatted.
+    vector<char> blocks((size_t) NUM_BLOCKS * BLOCK_SIZE, 0);
+    if (!new_disk && !disk_io(d, false, 0, NUM_BLOCKS, &blocks[0]))
+      memset(&blocks[0], 0, blocks.size());
+    for (int b = 0; b < NUM_BLOCKS; b++)
+      d.sums[b] = crc32c(&blocks[(size_t) b * BLOCK_SIZE], BLOCK_SIZE);
+    save_sums(d);
+    if (!new_disk)
+      cerr << "Block checksums were missing and have been rebuilt; "
+           << "the blocks on the disk are unverified" << endl;
+  }
+}
+
+// Checks count blocks just read from the disk against their checksums
+static void check_sums(const disk_t &d, int block_num, int count, const void *blocks)
+{
+  if (!d.summed) return;
+
+  for (int i = 0; i < count; i++) {
+    const char *block = (const char *) blocks + (size_t) i * BLOCK_SIZE;
+    if (crc32c(block, BLOCK_SIZE) != d.sums[block_num + i]) {
+      cerr << "Checksum mismatch on block " << block_num + i << endl;
+      exit(-1);
+    }
+  }
+}
+
+// Updates the checksums of count blocks about to be written to the disk
+static void update_sums(disk_t &d, int block_num, int count, const void *blocks)
+{
+  if (!d.summed) return;
+
+  for (int i = 0; i < count; i++) {
+    const char *block = (const char *) blocks + (size_t) i * BLOCK_SIZE;
+    d.sums[block_num + i] = crc32c(block, BLOCK_SIZE);
+  }
+}
+
+// Returns where the changed block map of a disk starts in its first member
+static off_t change_offset(const disk_t &d)
+{
+  const member_t &mem = d.members[0];
+  off_t sum_len = (off_t) mem.num_blocks * sizeof(unsigned int);
+
+  sum_len = (sum_len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+  return mem.data_offset + (off_t) (mem.num_blocks + 1) * BLOCK_SIZE + sum_len;
+}
+
+// Writes the header of the changed block map
+static void write_change_header(const disk_t &d, unsigned int magic)
+{
+  change_header_t header = { magic, d.generation };
+
+  if (pwrite(d.members[0].fd, &header, sizeof(header), change_offset(d)) !=
+      sizeof(header)) {
+    cerr << "Failed to write changed block map" << endl;
+    exit(-1);
+  }
+}
+
+// Loads the changed block map of a disk that was just opened. Without a
+// valid map every block counts as changed, so nothing can be missed, and
+// the disk moves to a new random generation, so no backup made before can
+// be followed by one made from now on.
+static void load_changes(disk_t &d, bool new_disk)
+{
+  change_header_t header = { 0, 0 };
+  off_t offset = change_offset(d);
+
+  if (!new_disk &&
+      pread(d.members[0].fd, &header, sizeof(header), offset) != sizeof(header))
+    header.magic = header.generation = 0;
+  d.generation = header.generation;
+
+  if (header.magic != CHANGE_MAGIC ||
+      pread(d.members[0].fd, d.changed, sizeof(d.changed), offset + BLOCK_SIZE) !=
+      sizeof(d.changed)) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(d.changed, 0xFF, sizeof(d.changed));
+    d.generation = (unsigned int) now.tv_nsec ^ (unsigned int) now.tv_sec ^
+      ((unsigned int) getpid() << 16) ^ (header.generation * 2654435761u);
+  }
+
+  write_change_header(d, 0);
+}
+
+// Writes the changed block map back and marks it valid
+static void save_changes(const disk_t &d)
+{
+  if (pwrite(d.members[0].fd, d.changed, sizeof(d.changed),
+             change_offset(d) + BLOCK_SIZE) != sizeof(d.changed)) {
+    cerr << "Failed to write changed block map" << endl;
+    exit(-1);
+  }
+  write_change_header(d, CHANGE_MAGIC);
+}
+
+// Writes the buffered trace records to the trace file
+static void flush_trace()
+{
+  size_t done = 0;
+
+  while (done < trace_buf.size()) {
+    ssize_t len = write(trace_fd, &trace_buf[0] + done, trace_buf.size() - done);
+    if (len <= 0) {
+      cerr << "Failed to write trace" << endl;
+      exit(-1);
+    }
+    done += len;
+  }
+  trace_buf.clear();
+}
+
+// Adds a record, and the name following it if there is one, to the trace
+static void trace(unsigned char type, int fd, int block, int count,
+                  const char *name = NULL)
+{
+  struct timespec now;
+  trace_rec_t rec;
+  long long delay;
+
+  if (trace_fd == -1) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  delay = (now.tv_sec - trace_last.tv_sec) * 1000000LL +
+    (now.tv_nsec - trace_last.tv_nsec) / 1000;
+  trace_last = now;
+
+  rec.delay = (delay > 0xFFFFFFFFLL) ? 0xFFFFFFFF : (unsigned int) delay;
+  rec.block = block;
+  rec.count = count;
+  rec.type = type;
+  rec.disk = fd;
+  rec.unused = 0;
+  trace_buf.insert(trace_buf.end(), (char *) &rec, (char *) (&rec + 1));
+  if (name != NULL)
+    trace_buf.insert(trace_buf.end(), name, name + count);
+  if (trace_buf.size() >= 65536)
+    flush_trace();
+}
+
+// Takes a free descriptor and sets up its layout
+static int new_disk_slot(int num_members, int stripe_unit)
+{
+  for (int fd = 0; fd < MAX_DISKS; fd++) {
+    if (disks[fd].mounted) continue;
+
+    disk_t &d = disks[fd];
+    d.mounted = true;
+    d.num_members = num_members;
+    d.stripe_unit = stripe_unit;
+    d.cache_blocks = NULL;
+    d.summed = false;
+    for (int m = 0; m < num_members; m++) {
+      d.members[m].fd = -1;
+      d.members[m].num_blocks = 0;
+      d.members[m].data_offset = (num_members > 1) ? BLOCK_SIZE : 0;
+    }
+    return fd;
+  }
+
+  cerr << "Too many disks mounted" << endl;
+  exit(-1);
+}
+
+// Counts the blocks each member holds once the layout is known
+static void count_member_blocks(disk_t &d)
+{
+  for (int m = 0; m < d.num_members; m++)
+    d.members[m].num_blocks = 0;
+  for (int b = 0; b < NUM_BLOCKS; b++) {
+    int member;
+    int local;
+    map_block(d, b, &member, &local);
+    d.members[member].num_blocks++;
+  }
+}
+
 bool mount_disk(const char *file_name, int *fd)
 {
-  *fd = open(file_name, O_RDWR);
-  if (*fd != -1) return false;
+  int file_fd;
+  bool created = false;
+
+  file_fd = open(file_name, O_RDWR);
+  if (file_fd == -1) {
+    file_fd = open(file_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (file_fd == -1) {
+      cerr << "Could not create disk" << endl;
+      exit(-1);
+    }
+    created = true;
+  }
+
+  *fd = new_disk_slot(1, NUM_BLOCKS);
+  disks[*fd].members[0].fd = file_fd;
+  count_member_blocks(disks[*fd]);
+  load_sums(disks[*fd], created);
+  load_changes(disks[*fd], created);
+  trace(TRACE_MOUNT, *fd, 1, NUM_BLOCKS);
+  return created;
+}
+
+bool mount_striped_disk(const char **file_names, int num_members, int stripe_unit, int *fd)
+{
+  int fds[MAX_MEMBERS];
+  label_t labels[MAX_MEMBERS];
+  int found = 0;
+  bool created;
 
-  *fd = open(file_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-  if (*fd == -1) {
-    cerr << "Could not create disk" << endl;
+  if (num_members < 1 || num_members > MAX_MEMBERS || stripe_unit < 1) {
+    cerr << "Invalid striped disk layout" << endl;
     exit(-1);
   }
+  if (num_members == 1) return mount_disk(file_names[0], fd);
 
-  return true;
+  for (int m = 0; m < num_members; m++) {
+    fds[m] = open(file_names[m], O_RDWR);
+    if (fds[m] != -1) found++;
+  }
+  if (found != 0 && found != num_members) {
+    cerr << "Striped disk is missing a member" << endl;
+    exit(-1);
+  }
+  created = (found == 0);
+
+  if (created) {
+    // Label every new member with the layout
+    unsigned int set_id = (unsigned int) time(NULL) ^ ((unsigned int) getpid() << 16);
+    for (int m = 0; m < num_members; m++) {
+      char block[BLOCK_SIZE];
+
+      fds[m] = open(file_names[m], O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+      if (fds[m] == -1) {
+        cerr << "Could not create disk" << endl;
+        exit(-1);
+      }
+      labels[m].magic = STRIPE_MAGIC;
+      labels[m].set_id = set_id;
+      labels[m].member = m;
+      labels[m].num_members = num_members;
+      labels[m].stripe_unit = stripe_unit;
+      memset(block, 0, BLOCK_SIZE);
+      memcpy(block, &labels[m], sizeof(label_t));
+      if (pwrite(fds[m], block, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+        cerr << "Failed to write disk label" << endl;
+        exit(-1);
+      }
+    }
+  }
+  else {
+    // The labels decide the order of the members and the stripe unit
+    for (int m = 0; m < num_members; m++) {
+      if (pread(fds[m], &labels[m], sizeof(label_t), 0) != sizeof(label_t) ||
+          labels[m].magic != STRIPE_MAGIC ||
+          labels[m].set_id != labels[0].set_id ||
+          labels[m].num_members != num_members ||
+          labels[m].stripe_unit != labels[0].stripe_unit ||
+          labels[m].member < 0 || labels[m].member >= num_members) {
+        cerr << file_names[m] << " is not a member of this striped disk" << endl;
+        exit(-1);
+      }
+    }
+    stripe_unit = labels[0].stripe_unit;
+  }
+
+  *fd = new_disk_slot(num_members, stripe_unit);
+  for (int m = 0; m < num_members; m++) {
+    member_t &mem = disks[*fd].members[labels[m].member];
+    if (mem.fd != -1) {
+      cerr << file_names[m] << " is a duplicate member of this striped disk" << endl;
+      exit(-1);
+    }
+    mem.fd = fds[m];
+  }
+  count_member_blocks(disks[*fd]);
+  start_workers(disks[*fd]);
+  load_sums(disks[*fd], created);
+  load_changes(disks[*fd], created);
+  trace(TRACE_MOUNT, *fd, num_members, stripe_unit);
+  return created;
 }
 
 void unmount_disk(int fd)
 {
-  close(fd);
+  disk_t &d = get_disk(fd);
+
+  save_changes(d);
+  trace(TRACE_UNMOUNT, fd, 0, 0);
+  if (trace_fd != -1) flush_trace();
+  stop_workers(d);
+  for (int m = 0; m < d.num_members; m++)
+    close(d.members[m].fd);
+  delete [] d.cache_blocks;
+  d.cache_blocks = NULL;
+  d.mounted = false;
+}
+
+void cache_disk(int fd)
+{
+  disk_t &d = get_disk(fd);
+
+  if (d.cache_blocks == NULL)
+    d.cache_blocks = new char[NUM_BLOCKS][BLOCK_SIZE];
+  for (int i = 0; i < NUM_BLOCKS; i++)
+    d.cache_valid[i] = false;
 }
   
+void trace_disks(const char *file_name)
+{
+  end_trace();
+  trace_fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (trace_fd == -1) {
+    cerr << "Could not create trace" << endl;
+    exit(-1);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &trace_last);
+}
+
+void trace_command(const char *name)
+{
+  trace(TRACE_COMMAND, 0, 0, strlen(name), name);
+}
+
+void end_trace()
+{
+  if (trace_fd == -1) return;
+
+  flush_trace();
+  close(trace_fd);
+  trace_fd = -1;
+}
+
+unsigned int changed_disk_blocks(int fd, bool *changed)
+{
+  disk_t &d = get_disk(fd);
+
+  for (int i = 0; i < NUM_BLOCKS; i++)
+    changed[i] = (d.changed[i / 8] >> (i % 8)) & 1;
+  return d.generation;
+}
+
+void checkpoint_disk(int fd, unsigned int generation)
+{
+  disk_t &d = get_disk(fd);
+
+  d.generation = generation;
+  memset(d.changed, 0, sizeof(d.changed));
+  write_change_header(d, 0);
+}
+
 void read_disk_block(int fd, int block_num, void *block)
 {
-  off_t offset;
-  off_t new_offset;
-  ssize_t size; 
+  if (block_num < 0 || block_num >= NUM_BLOCKS) {
+    cerr << "Invalid block size" << endl;
+    exit(-1);
+  }
+  read_disk_blocks(fd, block_num, 1, block);
+}
 
+void write_disk_block(int fd, int block_num, void *block)
+{
   if (block_num < 0 || block_num >= NUM_BLOCKS) {
     cerr << "Invalid block size" << endl;
     exit(-1);
   }
+  write_disk_blocks(fd, block_num, 1, block);
+}
+
+void read_disk_blocks(int fd, int block_num, int count, void *blocks)
+{
+  disk_t &d = get_disk(fd);
 
-  offset = block_num * BLOCK_SIZE;
-  new_offset = lseek(fd, offset, SEEK_SET);
-  if (offset != new_offset) {
-    cerr << "Seek failure" << endl;
+  if (block_num < 0 || count < 0 || block_num + count > NUM_BLOCKS) {
+    cerr << "Invalid block range" << endl;
     exit(-1);
   }
+  trace(TRACE_READ, fd, block_num, count);
 
-  size = read(fd, block, BLOCK_SIZE);
-  if (size != BLOCK_SIZE) {
+  if (d.cache_blocks != NULL) {
+    int i;
+    for (i = 0; i < count && d.cache_valid[block_num + i]; i++) ;
+    if (i == count) {
+      memcpy(blocks, d.cache_blocks[block_num], (size_t) count * BLOCK_SIZE);
+      return;
+    }
+  }
+
+  if (!disk_io(d, false, block_num, count, (char *) blocks)) {
     cerr << "Failed to read entire block" << endl;
     exit(-1);
   }
+  check_sums(d, block_num, count, blocks);
+
+  if (d.cache_blocks != NULL) {
+    memcpy(d.cache_blocks[block_num], blocks, (size_t) count * BLOCK_SIZE);
+    for (int i = 0; i < count; i++)
+      d.cache_valid[block_num + i] = true;
+  }
 }
 
-void write_disk_block(int fd, int block_num, void *block)
+void write_disk_blocks(int fd, int block_num, int count, void *blocks)
 {
-  off_t offset;
-  off_t new_offset;
-  ssize_t size; 
+  disk_t &d = get_disk(fd);
 
-  if (block_num < 0 || block_num >= NUM_BLOCKS) {
-    cerr << "Invalid block size" << endl;
+  if (block_num < 0 || count < 0 || block_num + count > NUM_BLOCKS) {
+    cerr << "Invalid block range" << endl;
     exit(-1);
   }
+  trace(TRACE_WRITE, fd, block_num, count);
 
-  offset = block_num * BLOCK_SIZE;
-  new_offset = lseek(fd, offset, SEEK_SET);
-  if (offset != new_offset) {
-    cerr << "Seek failure" << endl;
+  update_sums(d, block_num, count, blocks);
+  if (!disk_io(d, true, block_num, count, (char *) blocks)) {
+    cerr << "Failed to write entire block" << endl;
     exit(-1);
   }
+  for (int i = block_num; i < block_num + count; i++)
+    d.changed[i / 8] |= 1 << (i % 8);
 
-  size = write(fd, block, BLOCK_SIZE);
-  if (size != BLOCK_SIZE) {
-    cerr << "Failed to write entire block" << endl;
-    exit(-1);
+  if (d.cache_blocks != NULL) {
+    memcpy(d.cache_blocks[block_num], blocks, (size_t) count * BLOCK_SIZE);
+    for (int i = 0; i < count; i++)
+      d.cache_valid[block_num + i] = true;
   }
 }
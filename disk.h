@@ -7,16 +7,78 @@
 
 const int BLOCK_SIZE = 128;	    	 // must be an even power of two
 const int NUM_BLOCKS = (BLOCK_SIZE * 8); // set so a bitmap can fit in one block
+const int MAX_MEMBERS = 16;		 // most files a disk can be striped across
+
+// A trace (see trace_disks) is a run of these records. A TRACE_COMMAND
+// record is followed by count bytes naming the command; the requests after
+// it were made for that command.
+const unsigned char TRACE_MOUNT = 1;	 // block: members, count: stripe unit
+const unsigned char TRACE_UNMOUNT = 2;
+const unsigned char TRACE_READ = 3;	 // count blocks from block
+const unsigned char TRACE_WRITE = 4;
+const unsigned char TRACE_COMMAND = 5;	 // count: length of the name
+
+struct trace_rec_t {
+  unsigned int delay;			 // microseconds since the last record
+  short block;				 // first block of the request
+  short count;				 // number of blocks in the request
+  unsigned char type;			 // one of the TRACE_ types
+  unsigned char disk;			 // descriptor of the disk
+  short unused;
+};
 
 // Opens the file "file_name" that represents the disk.  If the file does
-// not exist,  file is created.  The descriptor is returned in output
-// parameter fd.  Returns true if a file is created and false if the file
-// exists.  Any error aborts the program.
+// not exist,  file is created.  A descriptor for the disk is returned in
+// output parameter fd.  Returns true if a file is created and false if the
+// file exists.  Any error aborts the program.
+//
+// Every block carries a CRC32C checksum, kept after the blocks in the
+// file. Checksums are verified when a block is read from the file and
+// written along with the block; a mismatch aborts the program. A disk
+// without checksums has them rebuilt, with a warning that its blocks are
+// unverified. Building with -DNO_CHECKSUMS turns this off.
 bool mount_disk(const char *filename, int *fd);
 
-// Closes the file descriptor that represents the disk.
+// Opens a disk striped across the num_members files in file_names: blocks
+// are dealt out to the members stripe_unit consecutive blocks at a time,
+// and requests covering several members go to all of them in parallel.
+// If none of the files exist they are all created, and each is labelled
+// with the layout. If they exist, the labels decide the order of the
+// members and the stripe unit, whatever order and unit are passed in.
+// Returns true if the files are created.  Any error aborts the program.
+bool mount_striped_disk(const char **file_names, int num_members,
+			int stripe_unit, int *fd);
+
+// Saves the changed block map and closes the files that make up the disk.
 void unmount_disk(int fd);
+
+// Keeps a write-through copy of every block of the disk pointed to by fd
+// in memory, so each block is only read from the file once. Nothing else
+// may write to the disk's files while it is cached.
+void cache_disk(int fd);
   
+// Sets changed[b] for every block b written since the last checkpoint and
+// returns the generation of that checkpoint. The record survives unmounting;
+// if the disk was not unmounted cleanly every block counts as changed and
+// the disk gets a new, random generation.
+unsigned int changed_disk_blocks(int fd, bool *changed);
+
+// Starts a new checkpoint numbered generation: no block counts as changed.
+// The generation is saved on the disk at once; the map is saved at unmount.
+void checkpoint_disk(int fd, unsigned int generation);
+
+// Starts recording every mount, unmount, read and write of every disk in
+// the trace file file_name, which is replaced. Records are buffered, and
+// written out whenever a disk is unmounted or the buffer fills up.
+void trace_disks(const char *file_name);
+
+// Notes in the trace that the requests which follow are for command name.
+// Does nothing unless a trace is being recorded.
+void trace_command(const char *name);
+
+// Writes out the rest of the trace and stops recording.
+void end_trace();
+
 // Reads disk block block_num from the disk pointed to by fd into the data
 // structure pointed to by block.
 void read_disk_block(int fd, int block_num, void *block);
@@ -24,4 +86,12 @@ void read_disk_block(int fd, int block_num, void *block);
 // Writes the data in block to disk block block_num pointed to by fd.
 void write_disk_block(int fd, int block_num, void *block);
 
+// Reads count consecutive disk blocks, starting at block_num, into the
+// buffer pointed to by blocks using a single request.
+void read_disk_blocks(int fd, int block_num, int count, void *blocks);
+
+// Writes count consecutive blocks from the buffer pointed to by blocks to
+// the disk, starting at block_num, using a single request.
+void write_disk_blocks(int fd, int block_num, int count, void *blocks);
+
 #endif
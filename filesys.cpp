@@ -5,18 +5,36 @@
 //Class; CPSC 341
 //This program simulates a unix file system that has the basic uni file system
 //commands implemented. These commands include cd, rmdir, rm, create, mkdir, space,
-//ls, append, and cat. These functions outline the basic program functions
+//ls, stat, append, cat, cp and mv, plus snap, snaps, rollback and rmsnap for snapshots,
+//import and export to copy files and directory trees to and from the host,
+//frag and defrag to report and repair fragmentation, and backup-delta and
+//backup-apply for incremental backups.
+//These functions outline the basic program functions
 // that allow for a unix file system. 
 
 
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
+#include <cerrno>
 #include <iostream> 
 #include <string>
+#include <sstream>
 #include <cmath>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 using namespace std;
 
 #include "disk.h"
@@ -28,6 +46,12 @@ struct cmd_t
 	char *data;		// data (append only)
 };
 bool make_cmd(char *cmd_str, struct cmd_t &command);
+bool run_cmd(int disk, char *cmd_str, short &curDir);
+void serve(int disk, const char *socket_name);
+void stop_serving(int sig);
+
+volatile sig_atomic_t stop_server = 0;	// set by SIGINT or SIGTERM
+bool treeReplaced = false;		// set by commands that replace the whole tree
 
 // Constants
 
@@ -41,8 +65,17 @@ const int MAX_BLOCKS = ((BLOCK_SIZE - 8) / 2);
 const int MAX_FILES = (BLOCK_SIZE / 8 - 1);
 const int MAX_FILE_SIZE	= (MAX_BLOCKS * BLOCK_SIZE);
 const int ROOT_DIR = 1;
+const int SNAP_DIR = 2;
+const char SNAP_TABLE_ERROR[] = "Block 2 is not a snapshot table: this disk was made before snapshots";
 const int FILE_BLOCK = 1;
 const int BYTE_SIZE = 8;
+const int HASH_BUCKETS = 256;
+const int MAX_WORKERS = 8;
+const int HOST_CHUNK_SIZE = 65536;
+const int ERROR_BUF_SIZE = 128;
+const int CLIENT_BUF_SIZE = 4096;
+const int STRIPE_UNIT = 8;
+const unsigned int BACKUP_MAGIC = 0x42444c54;
 
 // Block types
 
@@ -69,6 +102,81 @@ struct datablock_t {
 	char data[BLOCK_SIZE];	// data (BLOCK_SIZE bytes)
 };
 
+// A file being copied between the host and the disk image by import or
+// export. The workers only touch the host side; the image is only ever
+// changed by the main thread.
+struct hostfile_t {
+	string hostPath;		// path of the file on the host
+	short dirNum;			// directory holding the file in the image
+	char name[MAX_FNAME_SIZE];	// name of the file in the image
+	vector<char> data;		// contents of the file
+	const char *error;		// set if the host side failed
+	char errorBuf[ERROR_BUF_SIZE];	// text of a host error, for error
+	bool done;			// set once a worker is finished with it
+};
+
+// Start of a backup file written by backup-delta. It is followed by the
+// number of each block in it (a short each), then the blocks themselves.
+// A backup holding every block of the disk can be applied to any disk;
+// any other only to a copy left at checkpoint base.
+struct backup_t {
+	unsigned int magic;		// must be BACKUP_MAGIC
+	unsigned int base;		// checkpoint the blocks changed since
+	unsigned int checkpoint;	// checkpoint taken once it was written
+	int count;			// number of blocks in the backup
+};
+
+// A client connected to the server (-s)
+struct client_t {
+	int fd;				// connected socket
+	short curDir;			// current directory of this client
+	string in;			// received data not yet run
+	string out;			// replies not yet sent
+	bool quit;			// set once the client sent quit or hung up
+	bool closed;			// set once the socket can no longer be used
+	bool skipping;			// set while the rest of a long line is dropped
+};
+
+// Work queue shared by the host file workers. Files may still be added
+// (with addHostFile) while the workers run; a deque keeps the files
+// already handed out where they are.
+struct hostpool_t {
+	mutex lock;			// guards the list, next, adding and every done flag
+	condition_variable finished;	// signalled whenever a file is done
+	condition_variable added;	// signalled when a file is added or adding ends
+	size_t next;			// next file to hand out
+	bool adding;			// set while files may still be added
+};
+
+// Metadata index (-i). Built by walking the tree when the disk is opened
+// and kept up to date by writeDir(), writeInode() and reclaim_block(), so
+// namespace lookups need no disk reads.
+
+const char META_FREE = 0;	// not a directory or iNode
+const char META_DIR = 1;
+const char META_FILE = 2;
+
+struct meta_t {
+	char type;		// META_FREE, META_DIR or META_FILE
+	short parent;		// directory holding it (directories only)
+	unsigned int size;	// file size in bytes
+	short numBlocks;	// number of data blocks
+};
+
+bool indexMeta = false;			// keep the metadata index (-i)
+meta_t metaIndex[NUM_BLOCKS];		// index entry of every block
+dirblock_t *dirIndex[NUM_BLOCKS];	// contents of every indexed directory
+
+// Block ownership state. This is kept in memory only and is rebuilt by
+// walking the tree from ROOT_DIR every time the disk is opened.
+
+bool dedupBlocks = false;		// share identical full data blocks (-u)
+int refCount[NUM_BLOCKS];		// number of references held on each block
+unsigned int blockHash[NUM_BLOCKS];	// hash of each indexed data block
+short hashHead[HASH_BUCKETS];		// first indexed block of each bucket (0 - empty)
+short hashNext[NUM_BLOCKS];		// next indexed block in the same bucket
+bool hashed[NUM_BLOCKS];		// set if the block is in the dedup index
+
 
 // Command processing
 //this function intializes a new directory
@@ -88,24 +196,138 @@ dirblock_t deleteAll(short blockNum, int disk);
 //this function creates a file with iNode implementation
 void createF(dirblock_t curBlock, cmd_t command, short curDir, int disk);
 //this function appends to the current file
-void append(dirblock_t curBlock, cmd_t command, int disk);
+void append(dirblock_t curBlock, cmd_t command, short curDir, int disk);
 //this function outputs the iNode 
 void cat(dirblock_t curBlock, cmd_t command, int disk);
 //this function removes the iNode file given
 void rm(dirblock_t curBlock, cmd_t command, short curDir, int disk);
 //this function outputs the current space of the disk
 void space(int disk);
+//this function outputs the details of one file or directory
+void statF(dirblock_t curBlock, cmd_t command, int disk);
 //this function outputs the current taken blocks of the disk
 int getTaken(int disk);
 //this function initializes a iNode & returns it
 inode_t create();
+//this function copies a file by sharing its data blocks
+void cp(dirblock_t curBlock, cmd_t command, short curDir, int disk);
+//this function renames a file or directory or moves it to another directory
+void mv(dirblock_t curBlock, cmd_t command, short curDir, int disk);
+//this function returns the directory holding dirNum (0 if none)
+short findParent(int disk, short dirNum, short fromDir);
+//this function takes a snapshot of the whole file system
+void snap(cmd_t command, int disk);
+//this function lists the snapshots
+void snaps(int disk);
+//this function replaces the file system with a snapshot
+void rollback(cmd_t command, int disk);
+//this function deletes a snapshot
+void rmSnap(cmd_t command, int disk);
+//this function copies a host file or directory tree into the disk
+void importF(cmd_t command, short curDir, int disk);
+//this function copies a file or directory tree from the disk to the host
+void exportF(dirblock_t curBlock, cmd_t command, int disk);
+//this function reports how fragmented the files and free space are
+void frag(int disk);
+//this function moves file data into runs of consecutive blocks
+void defrag(cmd_t command, int disk);
+//this function writes the blocks changed since the last backup to a host file
+void backupDelta(cmd_t command, int disk);
+//this function writes the blocks of a backup file back to the disk
+void backupApply(cmd_t command, int disk);
+
+//block sharing functions
+//this function rebuilds the reference counts (and dedup index) from the tree
+void loadRefCounts(int disk);
+//this function counts the references held by a directory and its children
+void countRefs(int disk, short dirNum);
+//this function hashes the contents of a data block
+unsigned int hashBlock(const datablock_t &block);
+//this function adds a full data block to the dedup index
+void indexBlock(short blockNum, unsigned int hash);
+//this function removes a data block from the dedup index
+void unindexBlock(short blockNum);
+//this function returns an indexed block holding the same data (0 if none)
+short findDup(int disk, const datablock_t &block, unsigned int hash);
+//this function writes a full data block, sharing an identical one if possible
+short storeFullBlock(int disk, short blockNum, datablock_t &block);
+//this function drops a reference to a block, freeing it on the last one
+void releaseBlock(int disk, short blockNum);
+//this function appends len bytes of data to the end of an iNode's data
+bool appendBytes(int disk, inode_t &inode, const char *data, int len);
+//this function gives a shared iNode its own block before it is changed
+short cowInode(int disk, short inodeNum, inode_t &inode);
+//this function drops a reference to an iNode and the data it holds
+void releaseFile(int disk, short inodeNum);
+//this function releases a directory and everything below it
+void releaseTree(int disk, short dirNum);
+//this function fills dst with the entries of src, copying subdirectories
+bool copyEntries(int disk, const dirblock_t &src, dirblock_t &dst);
+//this function copies a directory tree, sharing the files in it
+short copyTree(int disk, short dirNum);
+//this function finds a snapshot by name in the snapshot table
+int findSnap(const dirblock_t &snapBlock, const char *name);
+
+//metadata index functions
+//this function reads a directory, from the index when it is kept
+void readDir(int disk, short dirNum, dirblock_t &dir);
+//this function writes a directory and updates the index
+void writeDir(int disk, short dirNum, dirblock_t &dir);
+//this function writes an iNode and updates the index
+void writeInode(int disk, short inodeNum, inode_t &inode);
+//this function records a directory in the index
+void indexDir(short dirNum, const dirblock_t &dir);
+//this function records an iNode in the index
+void indexInode(short inodeNum, const inode_t &inode);
+
+//host transfer functions
+//this function allocates count blocks at once, contiguous when possible
+bool get_free_run(int disk, int count, short *blocks);
+//this function returns a free entry for name in a directory (-1 if full, -2 if taken)
+int freeEntry(const dirblock_t &dir, const char *name);
+//this function adds a new empty directory under dirNum (0 if it failed)
+short importDir(int disk, short dirNum, const char *name);
+//this function walks a host directory, making directories and listing files
+void scanHostDir(int disk, const string &hostPath, short dirNum, deque<hostfile_t> &files);
+//this function writes a whole file into the disk as a new iNode
+bool writeFileData(int disk, const vector<char> &data, inode_t &inode);
+//this function reads the whole contents of an iNode
+void readFileData(int disk, const inode_t &inode, vector<char> &data);
+//this function walks a directory in the disk, making host directories and listing files
+void scanImageDir(int disk, short dirNum, const string &hostPath, deque<hostfile_t> &files, hostpool_t &pool);
+//this function reads a host file into memory
+const char *readHostFile(const string &hostPath, vector<char> &data, char *errorBuf);
+//this function writes memory out to a host file
+const char *writeHostFile(const string &hostPath, const vector<char> &data, char *errorBuf);
+//this function puts the text of an error number in a buffer
+const char *hostError(int err, char *errorBuf);
+//this function adds a file to the list the workers are working through
+void addHostFile(deque<hostfile_t> &files, hostpool_t &pool, const hostfile_t &file);
+//this function is run by each worker thread to work through the host files
+void hostWorker(deque<hostfile_t> *files, hostpool_t *pool, bool reading);
+//this function starts the worker threads for a list of host files
+void startWorkers(deque<hostfile_t> &files, hostpool_t &pool, bool reading, vector<thread> &workers);
+
+//fragmentation functions
+//this function finds count consecutive free blocks without taking them (0 if none)
+short find_free_run(int disk, int count);
+//this function counts the data blocks of an iNode and the runs they form
+int countExtents(const inode_t &inode, int &numBlocks);
+//this function reports the extents of every file under a directory
+void fragDir(int disk, short dirNum, const string &path, int &files, int &fragmented, int &extents);
+//this function moves the data of one file into a single run of blocks
+int defragFile(int disk, short inodeNum, int budget);
+//this function defragments every file under a directory until the budget runs out
+void defragDir(int disk, short dirNum, int &budget, int &moved, int &files);
 
 //core disk functions
 
-// Opens the simulated disk file. If a disk file is created, this
-// routines also "formats" the disk by initializing special blocks
-// 0 (superblock) and 1 (root directory). */
-int open_disk()
+// Opens the simulated disk file, or the files it is striped across when
+// num_members is more than one (DISK_NAME if there are none). If the disk
+// is created, this routines also "formats" the disk by initializing
+// special blocks 0 (superblock), 1 (root directory) and 2 (snapshot
+// table). */
+int open_disk(int num_members, const char **members, int stripe_unit)
 {
 	int fd;		// file descriptor for disk
 	bool new_disk;	// set if new disk was created
@@ -113,17 +335,30 @@ int open_disk()
 
 	struct superblock_t super_block;	// used to initialize block 0
 	struct dirblock_t dir_block;		// used to initialize block 1
-	struct datablock_t data_block;	// used to initialize other blocks
+	static struct datablock_t data_block[NUM_BLOCKS]; // used to initialize other blocks
 
 	// Mount the disk
-	new_disk = mount_disk(DISK_NAME, &fd);
+	if (num_members == 0)
+		new_disk = mount_disk(DISK_NAME, &fd);
+	else
+		new_disk = mount_striped_disk(members, num_members, stripe_unit, &fd);
 
 	// Check for a new disk.  If we have a new disk, we must continue and
-	// format the disk.
-	if (!new_disk) return fd;
+	// format the disk.  An old disk must have its snapshot table in block
+	// 2; on disks made before snapshots, block 2 holds user data.
+	if (!new_disk) {
+		read_disk_block(fd, 0, (void *) &super_block);
+		read_disk_block(fd, SNAP_DIR, (void *) &dir_block);
+		if (dir_block.magic != DIR_MAGIC_NUM ||
+		    !(super_block.bitmap[SNAP_DIR / 8] & (1 << (SNAP_DIR % 8)))) {
+			cerr << SNAP_TABLE_ERROR << endl;
+			exit(-1);
+		}
+		return fd;
+	}
 
 	// Initialize the superblock
-	super_block.bitmap[0] = 0x3;		// mark blocks 0 and 1 as used
+	super_block.bitmap[0] = 0x7;		// mark blocks 0, 1 and 2 as used
 	for (i = 1; i < BLOCK_SIZE; i++) {
 		super_block.bitmap[i] = 0;
 	}
@@ -138,18 +373,14 @@ int open_disk()
 		dir_block.dir_entries[i].block_num = 0;
 	}
 
-	// Write the root directory to block 1
+	// Write the root directory to block 1, and an empty copy of it to
+	// block 2 to hold the snapshot roots
 	write_disk_block(fd, 1, (void *) &dir_block);
+	write_disk_block(fd, SNAP_DIR, (void *) &dir_block);
 
-	// Initialize the data block to all zeroes
-	for (i = 0; i < BLOCK_SIZE; i++) {
-		data_block.data[i] = 0;
-	}
-
-	// Write the data block to all other blocks on disk
-	for (i = 2; i < NUM_BLOCKS; i++) {
-		write_disk_block(fd, i, (void *) &data_block);
-	}
+	// Write zeroes to all other blocks on disk in one request
+	memset(data_block, 0, sizeof(data_block));
+	write_disk_blocks(fd, 3, NUM_BLOCKS - 3, (void *) data_block);
 
 	return fd;
 }
@@ -178,6 +409,7 @@ short get_free_block(int disk)
 					// to superblock, and return block number.
 					super_block.bitmap[byte] |= mask;
 					write_disk_block(disk, 0, (void *) &super_block);
+					refCount[(byte * 8) + bit] = 1;
 					return (byte * 8) + bit;
 				}
 			}
@@ -201,24 +433,26 @@ void reclaim_block(int disk, short block_num)
 
 	// clear bit
 	super_block.bitmap[byte] &= mask;
+	refCount[block_num] = 0;
+	if (indexMeta) {
+		metaIndex[block_num].type = META_FREE;
+		delete dirIndex[block_num];
+		dirIndex[block_num] = NULL;
+	}
 
 	// write back superblock
 	write_disk_block(disk, 0, (void *) &super_block);
 }
 
-int main()
+int main(int argc, char *argv[])
 {
 	int disk;			  // file descriptor for disk
 	char cmd_str[MAX_CMD_LINE + 1]; // command line
-	struct cmd_t command;		  // command struct
-	bool status;			  // check for invalid command line
-	dirblock_t newBlock;	
-	dirblock_t curBlock;
-
-	inode_t tempFile;
-
-	short newBlockNum;
 	short curDir = ROOT_DIR;		//set to root directory initially
+	const char *socket_name = NULL;	  // socket to serve on (-s)
+	const char *trace_name = NULL;	  // trace of the disk requests (-r)
+	int stripe_unit = STRIPE_UNIT;	  // blocks per member when striped (-t)
+	int opt;			  // command line option
 	// Uncomment this section to make sure the size of the blocks are
 	// equal to the block size.
 #if 0
@@ -228,68 +462,341 @@ int main()
 	cout << "datablock size: " << sizeof(struct datablock_t) << endl;
 #endif
 
-	// Open the disk
-	disk = open_disk();
+	// Parse the command line options
+	while ((opt = getopt(argc, argv, "uir:s:t:")) != -1) {
+		if (opt == 'u')
+			dedupBlocks = true;
+		else if (opt == 'i')
+			indexMeta = true;
+		else if (opt == 'r')
+			trace_name = optarg;
+		else if (opt == 's')
+			socket_name = optarg;
+		else if (opt == 't' && atoi(optarg) > 0)
+			stripe_unit = atoi(optarg);
+		else {
+			cerr << "Usage: " << argv[0] << " [-u] [-i] [-r trace_file] [-s socket] [-t stripe_unit] [disk_file ...]" << endl;
+			exit(-1);
+		}
+	}
+	if (argc - optind > MAX_MEMBERS) {
+		cerr << "A disk can be striped across at most " << MAX_MEMBERS << " files" << endl;
+		exit(-1);
+	}
+
+	// Record the disk requests from the mount on
+	if (trace_name != NULL)
+		trace_disks(trace_name);
+
+	// Open the disk and find out who owns each block (and, with -i, what
+	// every directory and iNode holds)
+	disk = open_disk(argc - optind, (const char **) argv + optind, stripe_unit);
+	loadRefCounts(disk);
+
+	// In server mode the disk stays mounted for every client
+	if (socket_name != NULL) {
+		serve(disk, socket_name);
+		unmount_disk(disk);
+		end_trace();
+		return 0;
+	}
 
 	while (1) {
 
 		// Print prompt and get command line
 		cout << PROMPT_STRING;
-		if (fgets(cmd_str, MAX_CMD_LINE, stdin) == NULL) continue;
-
-		// Create the command structure, checking for invalid command lines
-		status = make_cmd(cmd_str, command);
-		if (!status) continue;
-
-		read_disk_block(disk, curDir, (void *) &curBlock);
-		// Look for the matching command
-		if (strcmp(command.cmd_name, "mkdir") == 0) 
-			makeDir(curBlock, command, curDir, disk);
-
-		else if (strcmp(command.cmd_name, "ls") == 0) 
-			ls(curBlock, command, disk);
-		
-		else if (strcmp(command.cmd_name, "cd") == 0) 
-			cd(curBlock, command, curDir, disk);
-		
-		else if (strcmp(command.cmd_name, "home") == 0) {
-			curDir = ROOT_DIR;
-			cout << "Home directory entered. " << endl;
-		}
-		else if (strcmp(command.cmd_name, "rmdir") == 0) 
-			rmDir(curBlock, command, curDir, disk);
-		
-		else if (strcmp(command.cmd_name, "create") == 0) 
-			createF(curBlock, command, curDir, disk);
-
-		else if (strcmp(command.cmd_name, "append") == 0) 
-			append(curBlock, command, disk);
-
-		else if (strcmp(command.cmd_name, "cat") == 0) 
-			cat(curBlock, command, disk);
-
-		else if (strcmp(command.cmd_name, "rm") == 0) 
-			rm(curBlock, command, curDir, disk);
-		
-		else if (strcmp(command.cmd_name, "space") == 0) 
-			space(disk);
-
-		else if (strcmp(command.cmd_name, "quit") == 0) {
+		// The end of the input is taken as quit
+		if (fgets(cmd_str, MAX_CMD_LINE, stdin) == NULL) {
+			cout << endl;
 			unmount_disk(disk);
+			end_trace();
 			exit(0);
 		}
-		else {
-			cerr << "ERROR: Invalid command not detected by make_cmd" << endl;
+
+		if (!run_cmd(disk, cmd_str, curDir)) {
+			unmount_disk(disk);
+			end_trace();
+			exit(0);
 		}
 	}
 
 	return 0;
 }
 
+// Parses and runs one command line against the directory curDir. Returns
+// false if the command line asks to quit.
+bool run_cmd(int disk, char *cmd_str, short &curDir)
+{
+	struct cmd_t command;		  // command struct
+	dirblock_t curBlock;		  // current directory
+
+	// Create the command structure, checking for invalid command lines
+	if (!make_cmd(cmd_str, command)) return true;
+	trace_command(command.cmd_name);
+
+	readDir(disk, curDir, curBlock);
+	// Look for the matching command
+	if (strcmp(command.cmd_name, "mkdir") == 0) 
+		makeDir(curBlock, command, curDir, disk);
+
+	else if (strcmp(command.cmd_name, "ls") == 0) 
+		ls(curBlock, command, disk);
+	
+	else if (strcmp(command.cmd_name, "cd") == 0) 
+		cd(curBlock, command, curDir, disk);
+	
+	else if (strcmp(command.cmd_name, "home") == 0) {
+		curDir = ROOT_DIR;
+		cout << "Home directory entered. " << endl;
+	}
+	else if (strcmp(command.cmd_name, "rmdir") == 0) 
+		rmDir(curBlock, command, curDir, disk);
+	
+	else if (strcmp(command.cmd_name, "create") == 0) 
+		createF(curBlock, command, curDir, disk);
+
+	else if (strcmp(command.cmd_name, "append") == 0) 
+		append(curBlock, command, curDir, disk);
+
+	else if (strcmp(command.cmd_name, "cat") == 0) 
+		cat(curBlock, command, disk);
+
+	else if (strcmp(command.cmd_name, "rm") == 0) 
+		rm(curBlock, command, curDir, disk);
+	
+	else if (strcmp(command.cmd_name, "space") == 0) 
+		space(disk);
+
+	else if (strcmp(command.cmd_name, "stat") == 0) 
+		statF(curBlock, command, disk);
+
+	else if (strcmp(command.cmd_name, "cp") == 0) 
+		cp(curBlock, command, curDir, disk);
+
+	else if (strcmp(command.cmd_name, "mv") == 0) 
+		mv(curBlock, command, curDir, disk);
+
+	else if (strcmp(command.cmd_name, "snap") == 0) 
+		snap(command, disk);
+
+	else if (strcmp(command.cmd_name, "snaps") == 0) 
+		snaps(disk);
+
+	else if (strcmp(command.cmd_name, "rollback") == 0) {
+		rollback(command, disk);
+		curDir = ROOT_DIR;
+		treeReplaced = true;
+	}
+	else if (strcmp(command.cmd_name, "rmsnap") == 0) 
+		rmSnap(command, disk);
+
+	else if (strcmp(command.cmd_name, "import") == 0) 
+		importF(command, curDir, disk);
+
+	else if (strcmp(command.cmd_name, "export") == 0) 
+		exportF(curBlock, command, disk);
+
+	else if (strcmp(command.cmd_name, "frag") == 0) 
+		frag(disk);
+
+	else if (strcmp(command.cmd_name, "defrag") == 0) 
+		defrag(command, disk);
+
+	else if (strcmp(command.cmd_name, "backup-delta") == 0) 
+		backupDelta(command, disk);
+
+	else if (strcmp(command.cmd_name, "backup-apply") == 0) {
+		backupApply(command, disk);
+		curDir = ROOT_DIR;
+		treeReplaced = true;
+	}
+
+	else if (strcmp(command.cmd_name, "quit") == 0) {
+		delete [] command.cmd_name;
+		return false;
+	}
+	else {
+		cerr << "ERROR: Invalid command not detected by make_cmd" << endl;
+	}
+
+	// the tokens all point into the string make_cmd allocated
+	delete [] command.cmd_name;
+	return true;
+}
+
+// Serves the command shell on a Unix domain socket until the process gets
+// SIGINT or SIGTERM. Each client has its own current directory and may send any
+// number of command lines without waiting; they are run in order and each
+// reply ends with the prompt. Commands from all clients are run one at a
+// time against the same mounted disk and block cache.
+void serve(int disk, const char *socket_name)
+{
+	struct sockaddr_un addr;	  // address of the socket
+	vector<client_t> clients;	  // connected clients
+	vector<struct pollfd> fds;	  // listening socket, then one per client
+	char buf[CLIENT_BUF_SIZE];	  // data read from a client
+	char cmd_str[MAX_CMD_LINE + 1];	  // command line
+	int listen_fd;
+	const string long_line = "Invalid command line: longer than " +
+		to_string(MAX_CMD_LINE) + " characters\n";
+
+	if (strlen(socket_name) >= sizeof(addr.sun_path)) {
+		cerr << "Socket name is too long" << endl;
+		exit(-1);
+	}
+
+	struct sigaction stop_action;	  // handler for SIGINT and SIGTERM
+
+	signal(SIGPIPE, SIG_IGN);
+	memset(&stop_action, 0, sizeof(stop_action));
+	stop_action.sa_handler = stop_serving;
+	sigaction(SIGINT, &stop_action, NULL);
+	sigaction(SIGTERM, &stop_action, NULL);
+	cache_disk(disk);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_name);
+	unlink(socket_name);
+	if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+		listen(listen_fd, SOMAXCONN) != 0) {
+		cerr << "Could not listen on " << socket_name << ": " << strerror(errno) << endl;
+		exit(-1);
+	}
+
+	while (!stop_server) {
+
+		// Wait on the listening socket and every client. Clients are only
+		// read from while their replies are not backed up.
+		fds.resize(clients.size() + 1);
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		for (size_t i = 0; i < clients.size(); i++) {
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events = 0;
+			if (clients[i].out.size() < CLIENT_BUF_SIZE * 16 && !clients[i].quit)
+				fds[i + 1].events |= POLLIN;
+			if (!clients[i].out.empty())
+				fds[i + 1].events |= POLLOUT;
+		}
+		if (poll(&fds[0], fds.size(), -1) == -1) {
+			if (errno == EINTR) continue;
+			cerr << "poll failed: " << strerror(errno) << endl;
+			exit(-1);
+		}
+
+		for (size_t i = 0; i < clients.size(); i++) {
+			client_t &client = clients[i];
+			short revents = fds[i + 1].revents;
+
+			if (revents & (POLLIN | POLLHUP | POLLERR)) {
+				ssize_t size = read(client.fd, buf, sizeof(buf));
+				if (size <= 0)
+					client.quit = client.closed = true;
+				else
+					client.in.append(buf, size);
+			}
+
+			// Drop what is left of a line that was too long
+			if (client.skipping) {
+				size_t end = client.in.find('\n');
+				client.skipping = (end == string::npos);
+				client.in.erase(0, client.skipping ? string::npos : end + 1);
+			}
+
+			// Run every complete command line that has arrived
+			size_t end;
+			while (!client.quit && (end = client.in.find('\n')) != string::npos) {
+				if (end >= (size_t) MAX_CMD_LINE) {
+					client.in.erase(0, end + 1);
+					client.out += long_line;
+					client.out += PROMPT_STRING;
+					continue;
+				}
+
+				ostringstream reply;
+				streambuf *old_out = cout.rdbuf(reply.rdbuf());
+				streambuf *old_err = cerr.rdbuf(reply.rdbuf());
+
+				memcpy(cmd_str, client.in.data(), end + 1);
+				cmd_str[end + 1] = 0;
+				client.in.erase(0, end + 1);
+				client.quit = !run_cmd(disk, cmd_str, client.curDir);
+				cout.rdbuf(old_out);
+				cerr.rdbuf(old_err);
+
+				client.out += reply.str();
+				if (!client.quit)
+					client.out += PROMPT_STRING;
+
+				// A command may have removed another client's directory,
+				// or replaced the whole tree (where a freed directory block
+				// may now hold a different directory)
+				for (size_t j = 0; j < clients.size(); j++)
+					if (treeReplaced || refCount[clients[j].curDir] == 0 ||
+						!isDir(clients[j].curDir, disk))
+						clients[j].curDir = ROOT_DIR;
+				treeReplaced = false;
+			}
+
+			// A line that is already too long is rejected without waiting
+			// for the rest of it
+			if (!client.quit && client.in.size() >= (size_t) MAX_CMD_LINE) {
+				client.in.clear();
+				client.skipping = true;
+				client.out += long_line;
+				client.out += PROMPT_STRING;
+			}
+
+			if (!client.out.empty() && !client.closed) {
+				ssize_t size = send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+				if (size > 0)
+					client.out.erase(0, size);
+				else if (size == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+					client.closed = true;
+			}
+		}
+
+		// Drop the clients that are gone or have quit and been answered
+		for (size_t i = clients.size(); i-- > 0; ) {
+			if (clients[i].closed || (clients[i].quit && clients[i].out.empty())) {
+				close(clients[i].fd);
+				clients.erase(clients.begin() + i);
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			client_t client;
+			client.fd = accept(listen_fd, NULL, NULL);
+			if (client.fd != -1) {
+				client.curDir = ROOT_DIR;
+				client.quit = client.closed = client.skipping = false;
+				client.out = PROMPT_STRING;
+				clients.push_back(client);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < clients.size(); i++)
+		close(clients[i].fd);
+	close(listen_fd);
+	unlink(socket_name);
+}
+
+// Asks serve() to stop once the current command is done
+void stop_serving(int sig)
+{
+	stop_server = 1;
+}
+
 //returns whether a block is a directory
 bool isDir(short blockNum, int disk)
 {
 	dirblock_t tempBlock;
+	if(indexMeta)
+		return metaIndex[blockNum].type == META_DIR;
+
 	read_disk_block(disk, blockNum, (void*) &tempBlock);
 
 	if(tempBlock.magic == DIR_MAGIC_NUM)
@@ -303,6 +810,10 @@ dirblock_t mkdir(){
 	dirblock_t tempDir;
 	tempDir.magic = DIR_MAGIC_NUM;
 	tempDir.num_entries = 0;
+	for(int i = 0; i < MAX_FILES; i++){
+		tempDir.dir_entries[i].name[0] = 0;
+		tempDir.dir_entries[i].block_num = 0;
+	}
 
 	return tempDir;
 }
@@ -340,12 +851,12 @@ void makeDir(dirblock_t curBlock, cmd_t command, int curDir, int disk){
 	if(!there && isSpace){
 		newBlock = mkdir();
 		newBlockNum = get_free_block(disk);
-		write_disk_block(disk, newBlockNum, (void *) &newBlock);
+		writeDir(disk, newBlockNum, newBlock);
 
 		strcpy(curBlock.dir_entries[curBlock.num_entries].name, command.file_name);
 		curBlock.dir_entries[curBlock.num_entries].block_num = newBlockNum;
 		curBlock.num_entries++;
-		write_disk_block(disk, curDir, (void *) &curBlock);
+		writeDir(disk, curDir, curBlock);
 		cout << "Directory " << command.file_name << " is created." << endl; 
 	}
 	else if(!there && !isSpace)
@@ -370,7 +881,10 @@ void ls(dirblock_t curBlock, cmd_t command, int disk){
 		}
 		else if(curBlock.dir_entries[i].block_num != 0)
 		{
-			read_disk_block(disk, curBlock.dir_entries[i].block_num, (void *) &tempBlock1);
+			if(indexMeta)
+				tempBlock1.size = metaIndex[curBlock.dir_entries[i].block_num].size;
+			else
+				read_disk_block(disk, curBlock.dir_entries[i].block_num, (void *) &tempBlock1);
 			numBlocks = ((tempBlock1.size/BLOCK_SIZE))+FILE_BLOCK;
 			cout << curBlock.dir_entries[i].name << "     " << curBlock.dir_entries[i].block_num 
 				<< "      " << "file" <<"      "<< tempBlock1.size << "      " << numBlocks << endl;
@@ -415,14 +929,14 @@ void rmDir(dirblock_t curBlock, cmd_t command, short curDir, int disk){
 		{	found = true;
 			if(isDir(curBlock.dir_entries[i].block_num, disk)){
 				dir = true;
-				read_disk_block(disk, curBlock.dir_entries[i].block_num, (void*) &tempBlock);
+				readDir(disk, curBlock.dir_entries[i].block_num, tempBlock);
 				if(tempBlock.num_entries == 0){
 					reclaim_block(disk, curBlock.dir_entries[i].block_num);
 					empty = true;
 					curBlock.num_entries--;
 					curBlock.dir_entries[i].block_num = 0;
 					strcpy(curBlock.dir_entries[i].name, name);
-					write_disk_block(disk, curDir, (void *) &curBlock);
+					writeDir(disk, curDir, curBlock);
 				}
 			}
 		}
@@ -444,7 +958,6 @@ void createF(dirblock_t curBlock, cmd_t command, short curDir, int disk){
 	bool isSpace = false;
 	int newBlockNum;
 	int emptyIndex;
-	char empty[BLOCK_SIZE] = "";
 	datablock_t tempDa;
 	int tempAdd;
 	for(int i = 0; i < MAX_FILES; i++)
@@ -474,10 +987,10 @@ void createF(dirblock_t curBlock, cmd_t command, short curDir, int disk){
 		}
 		newBlockNum = get_free_block(disk);
 		newFile.blocks[0] = newBlockNum;
-		strcpy(tempDa.data, empty);
+		memset(tempDa.data, 0, BLOCK_SIZE);
 
-		write_disk_block(disk, curDir, (void *) &curBlock);
-		write_disk_block(disk, tempAdd, (void *) &newFile);
+		writeDir(disk, curDir, curBlock);
+		writeInode(disk, tempAdd, newFile);
 		write_disk_block(disk, newBlockNum, (void*)&tempDa);
 
 		cout << "File " << command.file_name << " is now created. " << endl;
@@ -489,25 +1002,15 @@ void createF(dirblock_t curBlock, cmd_t command, short curDir, int disk){
 }
 
 //this functionw ill output to the current iNode that is passed in
-void append(dirblock_t curBlock, cmd_t command, int disk){
-	datablock_t tempData;
+void append(dirblock_t curBlock, cmd_t command, short curDir, int disk){
 	int sizeStr = (int)strlen(command.data);
-	int curIndex = 0;
-	int pastIndex = 0;
-	int fileInd = 0;
 	inode_t tempFile;
-	int newBlockNum;
-	bool start = true;
+	short inodeNum;
 	bool space = true;
+	bool diskFull = false;
 	bool file = false;
 	bool found = false;
 
-	//char *temp;
-	//
-	//temp = strchr(command.data, '\n');
-	//if(temp!= NULL) 
-	//	*temp = 0;
-
 	for(int i = 0; i < MAX_FILES; i++)
 	{
 		if(strcmp(command.file_name, curBlock.dir_entries[i].name) == 0)
@@ -516,52 +1019,27 @@ void append(dirblock_t curBlock, cmd_t command, int disk){
 			if(!isDir(curBlock.dir_entries[i].block_num, disk)){
 				file = true;
 				read_disk_block(disk, curBlock.dir_entries[i].block_num, (void*)&tempFile);
-				
-				if((ceil(tempFile.size+sizeStr)) > MAX_FILE_SIZE)
+
+				if(tempFile.size + sizeStr > MAX_FILE_SIZE){
 					space = false;
-				
-				for(int k = 0; k < MAX_BLOCKS; k++){
-					if(tempFile.blocks[k] != 0)
-					{
-						curIndex = k;
-						pastIndex = curIndex;
-					}
+					continue;
 				}
-				read_disk_block(disk, tempFile.blocks[curIndex], (void*) &tempData);
-					if(space){
-						for(int j = 0; j < sizeStr; j++)
-						{
-							
-							if(curIndex != pastIndex)
-							{
-								read_disk_block(disk, tempFile.blocks[curIndex], (void*) &tempData);
-								pastIndex = curIndex;
-							}
-
-							fileInd = (tempFile.size%128);
-
-							if(tempFile.size % 128 == 0 && !start && tempFile.size != MAX_FILE_SIZE)
-							{
-								newBlockNum = get_free_block(disk);
-								curIndex++;
-								read_disk_block(disk, tempFile.blocks[curIndex], (void*)&tempData);
-								tempData.data[0] = command.data[j];
-								tempFile.size++;
-								write_disk_block(disk, newBlockNum, (void*) &tempData);
-								tempFile.blocks[curIndex] = newBlockNum;
-							}
-							else{
-								tempData.data[fileInd] = command.data[j];
-								tempFile.size++;
-								write_disk_block(disk, tempFile.blocks[curIndex], (void*)&tempData);
-							}
-							start = false;
-
-						}
-						
-					}
-					write_disk_block(disk, curBlock.dir_entries[i].block_num, (void*)&tempFile);
-					
+
+				//a file shared with a copy or snapshot gets its own iNode first
+				inodeNum = cowInode(disk, curBlock.dir_entries[i].block_num, tempFile);
+				if(inodeNum == 0){
+					diskFull = true;
+					continue;
+				}
+				if(inodeNum != curBlock.dir_entries[i].block_num){
+					curBlock.dir_entries[i].block_num = inodeNum;
+					writeDir(disk, curDir, curBlock);
+				}
+
+				if(!appendBytes(disk, tempFile, command.data, sizeStr))
+					diskFull = true;
+
+				writeInode(disk, inodeNum, tempFile);
 			}
 		}
 
@@ -572,6 +1050,8 @@ void append(dirblock_t curBlock, cmd_t command, int disk){
 		cout << "This is a directory. Cannot output contents. " << endl;
 	else if(file && !space)
 		cout << "No more free space available in this file! " << endl;
+	else if(diskFull)
+		cout << "No more free space available on the disk! " << endl;
 
 }
 
@@ -619,36 +1099,19 @@ void cat(dirblock_t curBlock, cmd_t command, int disk){
 //this function removes the passed in block
 void rm(dirblock_t curBlock, cmd_t command, short curDir, int disk){
 	char name[MAX_FNAME_SIZE] = "";
-	char empty[BLOCK_SIZE] = "";
 	bool found = false;
-	inode_t tempFile;
-	inode_t tempFile2;
-	datablock_t dataTemp;
 	for(int i = 0; i < MAX_FILES; i++)
 	{
 		if(strcmp(command.file_name, curBlock.dir_entries[i].name) == 0)
 		{
 			if(!isDir(curBlock.dir_entries[i].block_num, disk)){
-				read_disk_block(disk, curBlock.dir_entries[i].block_num, (void*) &tempFile);
-				for(int j = 0; j < ((tempFile.size/BLOCK_SIZE)+FILE_BLOCK); j++)
-				{
-					if(tempFile.blocks[j] != 0){
-						read_disk_block(disk, tempFile.blocks[j], (void*)&dataTemp);
-						strcpy(dataTemp.data, empty);
-						write_disk_block(disk, tempFile.blocks[j], (void*)&dataTemp);
-						cout << tempFile.blocks[j] << endl;
-						reclaim_block(disk, tempFile.blocks[j]);
-						tempFile.blocks[j] = 0; 
-					}
-
-				}
-				reclaim_block(disk, curBlock.dir_entries[i].block_num);
+				releaseFile(disk, curBlock.dir_entries[i].block_num);
 
 				found = true;
 				curBlock.num_entries--;
 				curBlock.dir_entries[i].block_num = 0;
 				strcpy(curBlock.dir_entries[i].name, name);
-				write_disk_block(disk, curDir, (void *) &curBlock);
+				writeDir(disk, curDir, curBlock);
 			}
 		}
 	}
@@ -658,152 +1121,1801 @@ void rm(dirblock_t curBlock, cmd_t command, short curDir, int disk){
 		cout << "File not found. " << endl;	
 }
 
-//this function returns the space left in the disk
-void space(int disk)
-{
-	int totalSpace;
-	int available =0;
-	int taken = 0;
-	int byte; 
-	int bit;
-	superblock_t supBlock;
-
-	read_disk_block(disk, 0, (void*)&supBlock);
-
-	for (byte = 0; byte < BLOCK_SIZE; byte++) {
-		if (supBlock.bitmap[byte] != 0xFF) {
+//this function copies a file. The copy gets its own iNode but shares every
+//data block with the original until one of them is appended to.
+void cp(dirblock_t curBlock, cmd_t command, short curDir, int disk){
+	inode_t tempFile;
+	int srcIndex = -1;
+	int emptyIndex = -1;
+	bool there = false;
+	short newBlockNum;
 
-			// loop to check each bit
-			for (bit = 0; bit < BYTE_SIZE; bit++) {
-				int mask = 1 << bit;	// used to determine if bit is set or not
-				if (mask & ~supBlock.bitmap[byte])
-					available++;
-				else
-					taken++;
-			}
+	for(int i = 0; i < MAX_FILES; i++)
+	{
+		if(curBlock.dir_entries[i].block_num == 0){
+			emptyIndex = i;
+			continue;
 		}
-		else
-			taken += BYTE_SIZE;
+		if(strcmp(command.file_name, curBlock.dir_entries[i].name) == 0)
+			srcIndex = i;
+		if(strcmp(command.data, curBlock.dir_entries[i].name) == 0)
+			there = true;
 	}
-	totalSpace = (available+taken);
-	cout << "Available blocks: " << available  << endl;
-	cout << "Taken blocks: " << taken << endl;
-	cout << "Total blocks: " << totalSpace << endl;
-}
 
-//this function returns the amount of space taken in the disk
-int getTaken(int disk)
-{
-	int totalSpace;
-	int available = 0;
-	int taken = 0;
-	int byte; 
-	int bit;
-	superblock_t supBlock;
+	if(srcIndex == -1){
+		cout << "File " << command.file_name << " not found. " << endl;
+		return;
+	}
+	if(isDir(curBlock.dir_entries[srcIndex].block_num, disk)){
+		cout << "This is a directory. Cannot copy. " << endl;
+		return;
+	}
+	if(there){
+		cout << "File " << command.data << " is already created. " << endl;
+		return;
+	}
+	if(emptyIndex == -1 || getTaken(disk) >= NUM_BLOCKS){
+		cout << "There is no space for the file to be created in the current directory. " << endl;
+		return;
+	}
 
-	read_disk_block(disk, 0, (void*)&supBlock);
+	read_disk_block(disk, curBlock.dir_entries[srcIndex].block_num, (void*)&tempFile);
+	newBlockNum = get_free_block(disk);
+	for(int j = 0; j < MAX_BLOCKS; j++)
+		if(tempFile.blocks[j] != 0)
+			refCount[tempFile.blocks[j]]++;
+	writeInode(disk, newBlockNum, tempFile);
 
-	for (byte = 0; byte < BLOCK_SIZE; byte++) {
-		if (supBlock.bitmap[byte] != 0xFF) {
+	strcpy(curBlock.dir_entries[emptyIndex].name, command.data);
+	curBlock.dir_entries[emptyIndex].block_num = newBlockNum;
+	curBlock.num_entries++;
+	writeDir(disk, curDir, curBlock);
 
-			// loop to check each bit
-			for (bit = 0; bit < BYTE_SIZE; bit++) {
-				int mask = 1 << bit;	// used to determine if bit is set or not
-				if (!(mask & ~supBlock.bitmap[byte]))
-					taken++;
-			}
-		}
-		else
-			taken += BYTE_SIZE;
-	}
-	return taken;
+	cout << "File " << command.file_name << " copied to " << command.data << "." << endl;
 }
 
-bool make_cmd(char *cmd_str, struct cmd_t &command)
-{
-	const char *DELIM  = " \t\n"; // delimiters
-	int numtokens = 0;		// number of tokens
-	const char *snew;		// command string without leading spaces
-	char *temp_str;		// temporary string used by strtok
+//this function moves an entry of the current directory. If dst names a
+//directory here (or is .. for the parent) the entry is moved into it,
+//otherwise it is renamed to dst. Only the directory entries change; the
+//iNode and data blocks are left where they are.
+void mv(dirblock_t curBlock, cmd_t command, short curDir, int disk){
+	dirblock_t dstBlock;
+	int srcIndex = -1;
+	int dstIndex = -1;
+	int emptyIndex = -1;
+	short srcNum;
+	short dstDir = 0;
+	char name[MAX_FNAME_SIZE] = "";
 
-	// Remove spaces at beginning
-	snew = cmd_str + strspn(cmd_str, DELIM);
-	if (strlen(snew) == 0) {
-		cerr << "Empty command line" << endl;
-		return false;
+	for(int i = 0; i < MAX_FILES; i++)
+	{
+		if(curBlock.dir_entries[i].block_num == 0){
+			emptyIndex = i;
+			continue;
+		}
+		if(strcmp(command.file_name, curBlock.dir_entries[i].name) == 0)
+			srcIndex = i;
+		if(strcmp(command.data, curBlock.dir_entries[i].name) == 0)
+			dstIndex = i;
 	}
 
-	// Create new string
-	temp_str = (char *) new char[strlen(snew) + 1];
-	if (temp_str == NULL) {
-		cerr << "new failed" << endl; 
-		exit(-1);
+	if(srcIndex == -1){
+		cout << "File " << command.file_name << " not found. " << endl;
+		return;
 	}
-	strcpy(temp_str, snew);
+	srcNum = curBlock.dir_entries[srcIndex].block_num;
 
-	// Count the number of tokens in the command */
-	if (strtok(temp_str, DELIM) != NULL)
-		for (numtokens = 1; strtok(NULL, DELIM) != NULL; numtokens++) ; 
+	if(strcmp(command.data, "..") == 0){
+		dstDir = findParent(disk, curDir, ROOT_DIR);
+		if(dstDir == 0){
+			cout << "There is no parent directory. " << endl;
+			return;
+		}
+	}
+	else if(dstIndex != -1 && isDir(curBlock.dir_entries[dstIndex].block_num, disk))
+		dstDir = curBlock.dir_entries[dstIndex].block_num;
+	else if(dstIndex != -1){
+		cout << "File " << command.data << " is already created. " << endl;
+		return;
+	}
 
-	// Check for empty command line
-	if (numtokens == 0) {
-		cerr << "Empty command line" << endl;
-		delete [] temp_str;
-		return false;
+	// Rename in place: one directory write
+	if(dstDir == 0){
+		strcpy(curBlock.dir_entries[srcIndex].name, command.data);
+		writeDir(disk, curDir, curBlock);
+		cout << command.file_name << " renamed to " << command.data << "." << endl;
+		return;
 	}
 
-	// Extract the data
-	strcpy(temp_str, snew);
-	command.cmd_name = strtok(temp_str, DELIM);
-	if (numtokens > 1) command.file_name = strtok(NULL, DELIM);
-	if (numtokens > 2) command.data = strtok(NULL, DELIM);
+	// A directory cannot be moved into itself or anything below it
+	for(short d = dstDir; d != 0; d = findParent(disk, d, ROOT_DIR))
+		if(d == srcNum){
+			cout << "Cannot move a directory inside itself. " << endl;
+			return;
+		}
 
-	// Check for invalid command lines
-	if (strcmp(command.cmd_name, "ls") == 0 ||
-		strcmp(command.cmd_name, "home") == 0 ||
-		strcmp(command.cmd_name, "space") == 0 ||
-		strcmp(command.cmd_name, "quit") == 0)
+	readDir(disk, dstDir, dstBlock);
+	emptyIndex = -1;
+	for(int i = 0; i < MAX_FILES; i++)
 	{
-		if (numtokens != 1) {
-			cerr << "Invalid command line: " << command.cmd_name;
-			cerr << " has improper number of arguments" << endl;
-			return false;
+		if(dstBlock.dir_entries[i].block_num == 0)
+			emptyIndex = i;
+		else if(strcmp(command.file_name, dstBlock.dir_entries[i].name) == 0){
+			cout << "File " << command.file_name << " is already in " << command.data << ". " << endl;
+			return;
 		}
 	}
-	else if (strcmp(command.cmd_name, "mkdir") == 0 ||
-		strcmp(command.cmd_name, "cd") == 0 ||
-		strcmp(command.cmd_name, "rmdir") == 0 ||
-		strcmp(command.cmd_name, "create") == 0||
-		strcmp(command.cmd_name, "cat") == 0 ||
-		strcmp(command.cmd_name, "rm") == 0)
-	{
-		if (numtokens != 2) {
+	if(emptyIndex == -1){
+		cout << "There is no space for the file in " << command.data << ". " << endl;
+		return;
+	}
+
+	// Add to the destination before removing from the source, so a crash in
+	// between leaves an extra name rather than a lost file
+	strcpy(dstBlock.dir_entries[emptyIndex].name, command.file_name);
+	dstBlock.dir_entries[emptyIndex].block_num = srcNum;
+	dstBlock.num_entries++;
+	writeDir(disk, dstDir, dstBlock);
+
+	curBlock.num_entries--;
+	curBlock.dir_entries[srcIndex].block_num = 0;
+	strcpy(curBlock.dir_entries[srcIndex].name, name);
+	writeDir(disk, curDir, curBlock);
+
+	if(strcmp(command.data, "..") == 0)
+		cout << command.file_name << " moved to the parent directory." << endl;
+	else
+		cout << command.file_name << " moved to " << command.data << "." << endl;
+}
+
+//this function finds the directory that lists dirNum by searching down from
+//fromDir. With -i the parent is taken straight from the index.
+short findParent(int disk, short dirNum, short fromDir)
+{
+	dirblock_t dir;
+
+	if(dirNum == ROOT_DIR)
+		return 0;
+	if(indexMeta)
+		return metaIndex[dirNum].parent;
+
+	readDir(disk, fromDir, dir);
+	for(int i = 0; i < MAX_FILES; i++)
+	{
+		short blockNum = dir.dir_entries[i].block_num;
+		if(blockNum == dirNum)
+			return fromDir;
+	}
+	for(int i = 0; i < MAX_FILES; i++)
+	{
+		short blockNum = dir.dir_entries[i].block_num;
+		if(blockNum != 0 && isDir(blockNum, disk)){
+			short parent = findParent(disk, dirNum, blockNum);
+			if(parent != 0)
+				return parent;
+		}
+	}
+	return 0;
+}
+
+//this function takes a snapshot. Every directory from ROOT_DIR down is
+//copied; files are shared with the live tree until they change.
+void snap(cmd_t command, int disk){
+	dirblock_t snapBlock;
+	int emptyIndex = -1;
+	short rootNum;
+
+	readDir(disk, SNAP_DIR, snapBlock);
+	if(findSnap(snapBlock, command.file_name) != -1){
+		cout << "Snapshot " << command.file_name << " already exists." << endl;
+		return;
+	}
+	for(int i = 0; i < MAX_FILES; i++)
+		if(snapBlock.dir_entries[i].block_num == 0)
+			emptyIndex = i;
+	if(emptyIndex == -1){
+		cout << "There is no space for another snapshot. " << endl;
+		return;
+	}
+
+	rootNum = copyTree(disk, ROOT_DIR);
+	if(rootNum == 0){
+		cout << "There is no space on the disk for the snapshot. " << endl;
+		return;
+	}
+
+	strcpy(snapBlock.dir_entries[emptyIndex].name, command.file_name);
+	snapBlock.dir_entries[emptyIndex].block_num = rootNum;
+	snapBlock.num_entries++;
+	writeDir(disk, SNAP_DIR, snapBlock);
+	cout << "Snapshot " << command.file_name << " is created." << endl;
+}
+
+//this function lists the snapshots and the block holding each root
+void snaps(int disk){
+	dirblock_t snapBlock;
+
+	readDir(disk, SNAP_DIR, snapBlock);
+	cout << "Name  Block" << endl;
+	for(int i = 0; i < MAX_FILES; i++)
+		if(snapBlock.dir_entries[i].block_num != 0)
+			cout << snapBlock.dir_entries[i].name << "     "
+				<< snapBlock.dir_entries[i].block_num << endl;
+	cout << endl;
+}
+
+//this function throws away the live tree and replaces it with a copy of
+//the snapshot. The snapshot itself is kept.
+void rollback(cmd_t command, int disk){
+	dirblock_t snapBlock;
+	dirblock_t rootBlock;
+	dirblock_t tempBlock;
+	int index;
+
+	readDir(disk, SNAP_DIR, snapBlock);
+	index = findSnap(snapBlock, command.file_name);
+	if(index == -1){
+		cout << "Snapshot not found. " << endl;
+		return;
+	}
+
+	readDir(disk, ROOT_DIR, rootBlock);
+	for(int i = 0; i < MAX_FILES; i++)
+	{
+		short blockNum = rootBlock.dir_entries[i].block_num;
+		if(blockNum == 0)
+			continue;
+		if(isDir(blockNum, disk))
+			releaseTree(disk, blockNum);
+		else
+			releaseFile(disk, blockNum);
+	}
+
+	readDir(disk, snapBlock.dir_entries[index].block_num, tempBlock);
+	if(!copyEntries(disk, tempBlock, rootBlock))
+		cout << "There is no space on the disk to restore every directory. " << endl;
+	writeDir(disk, ROOT_DIR, rootBlock);
+	cout << "Rolled back to snapshot " << command.file_name << "." << endl;
+}
+
+//this function deletes a snapshot and drops its references
+void rmSnap(cmd_t command, int disk){
+	char name[MAX_FNAME_SIZE] = "";
+	dirblock_t snapBlock;
+	int index;
+
+	readDir(disk, SNAP_DIR, snapBlock);
+	index = findSnap(snapBlock, command.file_name);
+	if(index == -1){
+		cout << "Snapshot not found. " << endl;
+		return;
+	}
+
+	releaseTree(disk, snapBlock.dir_entries[index].block_num);
+	snapBlock.num_entries--;
+	snapBlock.dir_entries[index].block_num = 0;
+	strcpy(snapBlock.dir_entries[index].name, name);
+	writeDir(disk, SNAP_DIR, snapBlock);
+	cout << "Snapshot " << command.file_name << " deleted." << endl;
+}
+
+//this function imports a host file, or a whole host directory tree, into
+//the current directory under the given name. Host files are read by a
+//pool of workers while the main thread writes finished ones to the disk.
+void importF(cmd_t command, short curDir, int disk){
+	struct stat hostStat;
+	deque<hostfile_t> files;
+	vector<thread> workers;
+	hostpool_t pool;
+	dirblock_t dir;
+	inode_t newFile;
+	int imported = 0;
+
+	if(stat(command.file_name, &hostStat) != 0){
+		cout << "Host file " << command.file_name << " not found. " << endl;
+		return;
+	}
+
+	if(S_ISDIR(hostStat.st_mode)){
+		short dirNum = importDir(disk, curDir, command.data);
+		if(dirNum == 0)
+			return;
+		scanHostDir(disk, command.file_name, dirNum, files);
+	}
+	else{
+		hostfile_t file;
+		file.hostPath = command.file_name;
+		file.dirNum = curDir;
+		strcpy(file.name, command.data);
+		file.error = NULL;
+		file.done = false;
+		files.push_back(file);
+	}
+
+	pool.adding = false;
+	startWorkers(files, pool, true, workers);
+	for(size_t i = 0; i < files.size(); i++)
+	{
+		hostfile_t &file = files[i];
+		short inodeNum;
+		int index;
+
+		{
+			unique_lock<mutex> guard(pool.lock);
+			while(!file.done)
+				pool.finished.wait(guard);
+		}
+
+		if(file.error == NULL){
+			readDir(disk, file.dirNum, dir);
+			index = freeEntry(dir, file.name);
+			if(index == -2)
+				file.error = "file is already created";
+			else if(index == -1)
+				file.error = "no space in the directory";
+		}
+		if(file.error == NULL){
+			newFile = create();
+			inodeNum = get_free_block(disk);
+			if(inodeNum == 0 || !writeFileData(disk, file.data, newFile)){
+				if(inodeNum != 0)
+					reclaim_block(disk, inodeNum);
+				file.error = "no space on the disk";
+			}
+			else{
+				writeInode(disk, inodeNum, newFile);
+				strcpy(dir.dir_entries[index].name, file.name);
+				dir.dir_entries[index].block_num = inodeNum;
+				dir.num_entries++;
+				writeDir(disk, file.dirNum, dir);
+				imported++;
+			}
+		}
+		if(file.error != NULL)
+			cout << "Could not import " << file.hostPath << ": " << file.error << endl;
+		vector<char>().swap(file.data);
+	}
+	for(size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	cout << imported << " file(s) imported." << endl;
+}
+
+//this function exports a file, or a whole directory tree, from the current
+//directory to the host. The disk is read first and the host files are then
+//written by a pool of workers.
+void exportF(dirblock_t curBlock, cmd_t command, int disk){
+	deque<hostfile_t> files;
+	vector<thread> workers;
+	hostpool_t pool;
+	inode_t tempFile;
+	int exported = 0;
+	int index = -1;
+
+	for(int i = 0; i < MAX_FILES; i++)
+		if(curBlock.dir_entries[i].block_num != 0 &&
+			strcmp(command.file_name, curBlock.dir_entries[i].name) == 0)
+			index = i;
+	if(index == -1){
+		cout << "File not found. " << endl;
+		return;
+	}
+
+	if(isDir(curBlock.dir_entries[index].block_num, disk) &&
+		mkdir(command.data, 0755) != 0 && errno != EEXIST){
+		cout << "Could not create host directory " << command.data << ": " << strerror(errno) << endl;
+		return;
+	}
+
+	// The workers write each file out while the next is read from the disk
+	pool.adding = true;
+	startWorkers(files, pool, false, workers);
+	if(isDir(curBlock.dir_entries[index].block_num, disk))
+		scanImageDir(disk, curBlock.dir_entries[index].block_num, command.data, files, pool);
+	else{
+		hostfile_t file;
+		file.hostPath = command.data;
+		file.dirNum = 0;
+		strcpy(file.name, command.file_name);
+		file.error = NULL;
+		file.done = false;
+		read_disk_block(disk, curBlock.dir_entries[index].block_num, (void*)&tempFile);
+		readFileData(disk, tempFile, file.data);
+		addHostFile(files, pool, file);
+	}
+	{
+		lock_guard<mutex> guard(pool.lock);
+		pool.adding = false;
+	}
+	pool.added.notify_all();
+	for(size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	for(size_t i = 0; i < files.size(); i++)
+	{
+		if(files[i].error != NULL)
+			cout << "Could not export " << files[i].hostPath << ": " << files[i].error << endl;
+		else
+			exported++;
+	}
+	cout << exported << " file(s) exported." << endl;
+}
+
+//this function lists the extents (runs of consecutive data blocks) of
+//every file from ROOT_DIR down, then the sizes of the runs of free blocks
+void frag(int disk){
+	superblock_t supBlock;
+	int files = 0;
+	int fragmented = 0;
+	int extents = 0;
+	int runs[BYTE_SIZE * 2] = {0};	// runs[k] counts runs of 2^k to 2^(k+1)-1 blocks
+	int run = 0;
+
+	cout << "Path              Blocks  Extents" << endl;
+	fragDir(disk, ROOT_DIR, "", files, fragmented, extents);
+	cout << "Files: " << files << "  Fragmented: " << fragmented
+		<< "  Extents: " << extents << endl << endl;
+
+	read_disk_block(disk, 0, (void*)&supBlock);
+	for(int b = 0; b <= NUM_BLOCKS; b++)
+	{
+		if(b < NUM_BLOCKS && !(supBlock.bitmap[b / BYTE_SIZE] & (1 << (b % BYTE_SIZE)))){
+			run++;
+			continue;
+		}
+		if(run > 0){
+			int k = 0;
+			while((2 << k) <= run)
+				k++;
+			runs[k]++;
+		}
+		run = 0;
+	}
+
+	cout << "Free run  Count" << endl;
+	for(int k = 0; (1 << k) <= NUM_BLOCKS; k++)
+	{
+		if(runs[k] == 0)
+			continue;
+		if(k == 0)
+			cout << 1;
+		else
+			cout << (1 << k) << "-" << (2 << k) - 1;
+		cout << "      " << runs[k] << endl;
+	}
+	cout << endl;
+}
+
+//this function moves file data into runs of consecutive blocks, one file
+//at a time. Each file is copied to a free run and then switched over with
+//a single write of its iNode, so a file is never seen half moved. With a
+//number, at most that many blocks are moved by one command, so a large
+//disk can be done a bit at a time while other clients keep working.
+void defrag(cmd_t command, int disk){
+	int budget = NUM_BLOCKS;
+	int moved = 0;
+	int files = 0;
+
+	if(command.file_name != NULL)
+		budget = atoi(command.file_name);
+
+	defragDir(disk, ROOT_DIR, budget, moved, files);
+	cout << moved << " block(s) in " << files << " file(s) moved." << endl;
+}
+
+//this function writes every block changed since the last checkpoint to a
+//host file, then takes a new checkpoint. The first backup of a disk, or
+//one after the disk was not unmounted cleanly, holds every block.
+void backupDelta(cmd_t command, int disk){
+	bool changed[NUM_BLOCKS];
+	backup_t header;
+	vector<char> out;
+	short *blockNums;
+	char *blocks;
+	const char *error;
+	char errorBuf[ERROR_BUF_SIZE];
+
+	header.magic = BACKUP_MAGIC;
+	header.base = changed_disk_blocks(disk, changed);
+	header.checkpoint = header.base + 1;
+	header.count = 0;
+	for(int i = 0; i < NUM_BLOCKS; i++)
+		if(changed[i])
+			header.count++;
+
+	out.resize(sizeof(header) + header.count * (sizeof(short) + BLOCK_SIZE));
+	memcpy(&out[0], &header, sizeof(header));
+	blockNums = (short*)(&out[0] + sizeof(header));
+	blocks = (char*)(blockNums + header.count);
+
+	// Read each run of changed blocks with one request
+	for(int i = 0, n = 0; i < NUM_BLOCKS; )
+	{
+		int len = 0;
+		if(!changed[i]){
+			i++;
+			continue;
+		}
+		while(i + len < NUM_BLOCKS && changed[i + len]){
+			blockNums[n + len] = i + len;
+			len++;
+		}
+		read_disk_blocks(disk, i, len, blocks + n * BLOCK_SIZE);
+		n += len;
+		i += len;
+	}
+
+	error = writeHostFile(command.file_name, out, errorBuf);
+	if(error != NULL){
+		cout << "Could not write " << command.file_name << ": " << error << endl;
+		return;
+	}
+	checkpoint_disk(disk, header.checkpoint);
+	cout << header.count << " changed block(s) written to " << command.file_name;
+	cout << " (checkpoint " << header.checkpoint << ")." << endl;
+}
+
+//this function writes the blocks in a backup file to the disk and takes
+//its checkpoint, so the next backup can be applied after it. Backups must
+//be applied in the order they were made, starting from one holding every
+//block, to a disk that has not been changed in between.
+void backupApply(cmd_t command, int disk){
+	bool changed[NUM_BLOCKS];
+	backup_t header;
+	vector<char> in;
+	const short *blockNums;
+	const char *blocks;
+	unsigned int checkpoint;
+	bool dirty = false;
+	int fd;
+	ssize_t size;
+
+	fd = open(command.file_name, O_RDONLY);
+	if(fd == -1){
+		cout << "Could not read " << command.file_name << ": " << strerror(errno) << endl;
+		return;
+	}
+	do{
+		size_t used = in.size();
+		in.resize(used + HOST_CHUNK_SIZE);
+		size = read(fd, &in[0] + used, HOST_CHUNK_SIZE);
+		in.resize(used + (size > 0 ? size : 0));
+	}while(size > 0);
+	close(fd);
+
+	if(size < 0 || in.size() < sizeof(header)){
+		cout << command.file_name << " is not a backup. " << endl;
+		return;
+	}
+	memcpy(&header, &in[0], sizeof(header));
+	if(header.magic != BACKUP_MAGIC || header.count < 0 || header.count > NUM_BLOCKS ||
+		in.size() != sizeof(header) + header.count * (sizeof(short) + BLOCK_SIZE)){
+		cout << command.file_name << " is not a backup. " << endl;
+		return;
+	}
+	blockNums = (const short*)(&in[0] + sizeof(header));
+	blocks = (const char*)(blockNums + header.count);
+	for(int i = 0; i < header.count; i++)
+		if(blockNums[i] < 0 || blockNums[i] >= NUM_BLOCKS){
+			cout << command.file_name << " is not a backup. " << endl;
+			return;
+		}
+
+	checkpoint = changed_disk_blocks(disk, changed);
+	for(int i = 0; i < NUM_BLOCKS; i++)
+		if(changed[i])
+			dirty = true;
+	if(header.count < NUM_BLOCKS && (checkpoint != header.base || dirty)){
+		cout << "This backup only applies to a disk at checkpoint " << header.base;
+		cout << " with no changes since. " << endl;
+		return;
+	}
+
+	// Write each run of consecutive blocks with one request
+	for(int i = 0; i < header.count; )
+	{
+		int len = 1;
+		while(i + len < header.count && blockNums[i + len] == blockNums[i] + len)
+			len++;
+		write_disk_blocks(disk, blockNums[i], len, (void*)(blocks + i * BLOCK_SIZE));
+		i += len;
+	}
+	checkpoint_disk(disk, header.checkpoint);
+
+	loadRefCounts(disk);
+	cout << header.count << " block(s) restored from " << command.file_name;
+	cout << " (checkpoint " << header.checkpoint << ")." << endl;
+}
+
+//this function outputs the block, type, size and references of an entry
+//in the current directory. With -i this needs no disk reads.
+void statF(dirblock_t curBlock, cmd_t command, int disk){
+	inode_t tempFile;
+	short blockNum = 0;
+	unsigned int size;
+	int numBlocks;
+
+	for(int i = 0; i < MAX_FILES; i++)
+		if(curBlock.dir_entries[i].block_num != 0 &&
+			strcmp(command.file_name, curBlock.dir_entries[i].name) == 0)
+			blockNum = curBlock.dir_entries[i].block_num;
+	if(blockNum == 0){
+		cout << "File not found. " << endl;
+		return;
+	}
+
+	cout << "Name: " << command.file_name << endl;
+	cout << "Block: " << blockNum << endl;
+	if(isDir(blockNum, disk)){
+		cout << "Type: dir" << endl;
+		cout << "References: " << refCount[blockNum] << endl << endl;
+		return;
+	}
+
+	if(indexMeta){
+		size = metaIndex[blockNum].size;
+		numBlocks = metaIndex[blockNum].numBlocks;
+	}
+	else{
+		read_disk_block(disk, blockNum, (void*)&tempFile);
+		size = tempFile.size;
+		countExtents(tempFile, numBlocks);
+	}
+	cout << "Type: file" << endl;
+	cout << "Bytes: " << size << endl;
+	cout << "Data blocks: " << numBlocks << endl;
+	cout << "References: " << refCount[blockNum] << endl << endl;
+}
+
+//this function returns the space left in the disk
+void space(int disk)
+{
+	int totalSpace;
+	int available =0;
+	int taken = 0;
+	int byte; 
+	int bit;
+	superblock_t supBlock;
+
+	read_disk_block(disk, 0, (void*)&supBlock);
+
+	for (byte = 0; byte < BLOCK_SIZE; byte++) {
+		if (supBlock.bitmap[byte] != 0xFF) {
+
+			// loop to check each bit
+			for (bit = 0; bit < BYTE_SIZE; bit++) {
+				int mask = 1 << bit;	// used to determine if bit is set or not
+				if (mask & ~supBlock.bitmap[byte])
+					available++;
+				else
+					taken++;
+			}
+		}
+		else
+			taken += BYTE_SIZE;
+	}
+	totalSpace = (available+taken);
+	cout << "Available blocks: " << available  << endl;
+	cout << "Taken blocks: " << taken << endl;
+	cout << "Total blocks: " << totalSpace << endl;
+}
+
+//this function returns the amount of space taken in the disk
+int getTaken(int disk)
+{
+	int totalSpace;
+	int available = 0;
+	int taken = 0;
+	int byte; 
+	int bit;
+	superblock_t supBlock;
+
+	read_disk_block(disk, 0, (void*)&supBlock);
+
+	for (byte = 0; byte < BLOCK_SIZE; byte++) {
+		if (supBlock.bitmap[byte] != 0xFF) {
+
+			// loop to check each bit
+			for (bit = 0; bit < BYTE_SIZE; bit++) {
+				int mask = 1 << bit;	// used to determine if bit is set or not
+				if (!(mask & ~supBlock.bitmap[byte]))
+					taken++;
+			}
+		}
+		else
+			taken += BYTE_SIZE;
+	}
+	return taken;
+}
+
+//this function rebuilds the reference counts of every block by walking
+//the tree from ROOT_DIR and from every snapshot root. With -u the full data blocks are also hashed so
+//that later writes can be matched against them.
+void loadRefCounts(int disk)
+{
+	for(int i = 0; i < NUM_BLOCKS; i++){
+		refCount[i] = 0;
+		hashNext[i] = 0;
+		hashed[i] = false;
+		metaIndex[i].type = META_FREE;
+		delete dirIndex[i];
+		dirIndex[i] = NULL;
+	}
+	for(int i = 0; i < HASH_BUCKETS; i++)
+		hashHead[i] = 0;
+
+	refCount[0] = 1;
+	refCount[ROOT_DIR] = 1;
+	refCount[SNAP_DIR] = 1;
+	countRefs(disk, ROOT_DIR);
+	countRefs(disk, SNAP_DIR);
+}
+
+//this function counts the references held by a directory. Every entry is
+//one reference; children are only walked the first time they are seen.
+void countRefs(int disk, short dirNum)
+{
+	dirblock_t dir;
+	inode_t tempFile;
+	datablock_t tempData;
+
+	read_disk_block(disk, dirNum, (void*)&dir);
+	if(indexMeta)
+		indexDir(dirNum, dir);
+	for(int i = 0; i < MAX_FILES; i++)
+	{
+		short blockNum = dir.dir_entries[i].block_num;
+		if(blockNum == SNAP_DIR){
+			cerr << SNAP_TABLE_ERROR << endl;
+			exit(-1);
+		}
+		if(blockNum <= SNAP_DIR || blockNum >= NUM_BLOCKS)
+			continue;
+
+		refCount[blockNum]++;
+		if(refCount[blockNum] > 1)
+			continue;
+
+		read_disk_block(disk, blockNum, (void*)&tempFile);
+		if(tempFile.magic == DIR_MAGIC_NUM)
+			countRefs(disk, blockNum);
+		else if(tempFile.magic == INODE_MAGIC_NUM)
+		{
+			if(indexMeta)
+				indexInode(blockNum, tempFile);
+			for(int j = 0; j < MAX_BLOCKS; j++)
+			{
+				short dataNum = tempFile.blocks[j];
+				if(dataNum <= SNAP_DIR || dataNum >= NUM_BLOCKS)
+					continue;
+
+				refCount[dataNum]++;
+				if(dedupBlocks && refCount[dataNum] == 1 && j < (int)(tempFile.size/BLOCK_SIZE)){
+					read_disk_block(disk, dataNum, (void*)&tempData);
+					indexBlock(dataNum, hashBlock(tempData));
+				}
+			}
+		}
+	}
+}
+
+//this function hashes a data block (32 bit FNV-1a)
+unsigned int hashBlock(const datablock_t &block)
+{
+	unsigned int hash = 2166136261u;
+	for(int i = 0; i < BLOCK_SIZE; i++){
+		hash ^= (unsigned char) block.data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+//this function adds a block to the front of its hash bucket
+void indexBlock(short blockNum, unsigned int hash)
+{
+	int bucket = hash % HASH_BUCKETS;
+	blockHash[blockNum] = hash;
+	hashNext[blockNum] = hashHead[bucket];
+	hashHead[bucket] = blockNum;
+	hashed[blockNum] = true;
+}
+
+//this function unlinks a block from its hash bucket
+void unindexBlock(short blockNum)
+{
+	short *link = &hashHead[blockHash[blockNum] % HASH_BUCKETS];
+
+	if(!hashed[blockNum])
+		return;
+	while(*link != blockNum)
+		link = &hashNext[*link];
+	*link = hashNext[blockNum];
+	hashNext[blockNum] = 0;
+	hashed[blockNum] = false;
+}
+
+//this function looks for an indexed block with the same contents. Hashes
+//only pick the candidates; the data itself is compared before sharing.
+short findDup(int disk, const datablock_t &block, unsigned int hash)
+{
+	datablock_t candidate;
+
+	for(short b = hashHead[hash % HASH_BUCKETS]; b != 0; b = hashNext[b])
+	{
+		if(blockHash[b] != hash)
+			continue;
+		read_disk_block(disk, b, (void*)&candidate);
+		if(memcmp(candidate.data, block.data, BLOCK_SIZE) == 0)
+			return b;
+	}
+	return 0;
+}
+
+//this function writes a block that has just been filled. With -u an
+//identical block already on disk is shared instead, and blockNum is given
+//back. Returns the block that now holds the data.
+short storeFullBlock(int disk, short blockNum, datablock_t &block)
+{
+	unsigned int hash;
+	short dup;
+
+	if(!dedupBlocks){
+		write_disk_block(disk, blockNum, (void*)&block);
+		return blockNum;
+	}
+
+	hash = hashBlock(block);
+	dup = findDup(disk, block, hash);
+	if(dup != 0 && dup != blockNum){
+		refCount[dup]++;
+		releaseBlock(disk, blockNum);
+		return dup;
+	}
+
+	write_disk_block(disk, blockNum, (void*)&block);
+	if(dup == 0)
+		indexBlock(blockNum, hash);
+	return blockNum;
+}
+
+//this function drops one reference to a block and only frees it once
+//nothing refers to it anymore
+void releaseBlock(int disk, short blockNum)
+{
+	if(refCount[blockNum] > 1){
+		refCount[blockNum]--;
+		return;
+	}
+	unindexBlock(blockNum);
+	reclaim_block(disk, blockNum);
+}
+
+//this function appends data to an iNode one block at a time. A shared
+//partial block is copied before it is written. Returns false if the disk
+//fills up, leaving the iNode describing whatever was written.
+bool appendBytes(int disk, inode_t &inode, const char *data, int len)
+{
+	datablock_t block;
+	int done = 0;
+
+	while(done < len)
+	{
+		int index = inode.size / BLOCK_SIZE;
+		int offset = inode.size % BLOCK_SIZE;
+		int count = BLOCK_SIZE - offset;
+		short blockNum = inode.blocks[index];
+
+		if(count > len - done)
+			count = len - done;
+
+		if(blockNum == 0){
+			blockNum = get_free_block(disk);
+			if(blockNum == 0)
+				return false;
+			memset(block.data, 0, BLOCK_SIZE);
+		}
+		else{
+			read_disk_block(disk, blockNum, (void*)&block);
+			if(refCount[blockNum] > 1){
+				short copyNum = get_free_block(disk);
+				if(copyNum == 0)
+					return false;
+				releaseBlock(disk, blockNum);
+				blockNum = copyNum;
+			}
+		}
+
+		memcpy(block.data + offset, data + done, count);
+		inode.size += count;
+		done += count;
+
+		if(offset + count == BLOCK_SIZE)
+			blockNum = storeFullBlock(disk, blockNum, block);
+		else
+			write_disk_block(disk, blockNum, (void*)&block);
+		inode.blocks[index] = blockNum;
+	}
+	return true;
+}
+
+//this function makes sure the caller holds the only reference to an iNode.
+//A shared iNode is copied to a new block and every data block it points at
+//gains a reference. Returns the block to write the iNode to (0 if full).
+short cowInode(int disk, short inodeNum, inode_t &inode)
+{
+	short newNum;
+
+	if(refCount[inodeNum] <= 1)
+		return inodeNum;
+
+	newNum = get_free_block(disk);
+	if(newNum == 0)
+		return 0;
+	for(int j = 0; j < MAX_BLOCKS; j++)
+		if(inode.blocks[j] != 0)
+			refCount[inode.blocks[j]]++;
+	releaseBlock(disk, inodeNum);
+	writeInode(disk, newNum, inode);
+	return newNum;
+}
+
+//this function drops a reference to an iNode. The data blocks are only
+//released along with the last reference to the iNode itself.
+void releaseFile(int disk, short inodeNum)
+{
+	inode_t tempFile;
+
+	if(refCount[inodeNum] > 1){
+		refCount[inodeNum]--;
+		return;
+	}
+
+	read_disk_block(disk, inodeNum, (void*)&tempFile);
+	for(int j = 0; j < MAX_BLOCKS; j++)
+		if(tempFile.blocks[j] != 0)
+			releaseBlock(disk, tempFile.blocks[j]);
+	releaseBlock(disk, inodeNum);
+}
+
+//this function releases a directory block and everything under it
+void releaseTree(int disk, short dirNum)
+{
+	dirblock_t dir;
+
+	readDir(disk, dirNum, dir);
+	for(int i = 0; i < MAX_FILES; i++)
+	{
+		short blockNum = dir.dir_entries[i].block_num;
+		if(blockNum == 0)
+			continue;
+		if(isDir(blockNum, disk))
+			releaseTree(disk, blockNum);
+		else
+			releaseFile(disk, blockNum);
+	}
+	releaseBlock(disk, dirNum);
+}
+
+//this function copies the entries of src into dst. Subdirectories are
+//copied block by block, files only gain a reference. On a full disk the
+//entries that could not be copied are left out and false is returned.
+bool copyEntries(int disk, const dirblock_t &src, dirblock_t &dst)
+{
+	bool ok = true;
+
+	dst = src;
+	for(int i = 0; i < MAX_FILES; i++)
+	{
+		short blockNum = src.dir_entries[i].block_num;
+		if(blockNum == 0)
+			continue;
+		if(!isDir(blockNum, disk))
+			refCount[blockNum]++;
+		else{
+			dst.dir_entries[i].block_num = copyTree(disk, blockNum);
+			if(dst.dir_entries[i].block_num == 0){
+				dst.dir_entries[i].name[0] = 0;
+				dst.num_entries--;
+				ok = false;
+			}
+		}
+	}
+	return ok;
+}
+
+//this function copies a directory tree and returns the block of the new
+//top directory (0 if the disk filled up, in which case nothing is kept)
+short copyTree(int disk, short dirNum)
+{
+	dirblock_t src;
+	dirblock_t dst;
+	short newNum;
+	bool ok;
+
+	newNum = get_free_block(disk);
+	if(newNum == 0)
+		return 0;
+
+	readDir(disk, dirNum, src);
+	ok = copyEntries(disk, src, dst);
+	writeDir(disk, newNum, dst);
+	if(!ok){
+		releaseTree(disk, newNum);
+		return 0;
+	}
+	return newNum;
+}
+
+//this function reads a directory. With -i the copy in the index is used.
+void readDir(int disk, short dirNum, dirblock_t &dir)
+{
+	if(indexMeta && dirIndex[dirNum] != NULL)
+		dir = *dirIndex[dirNum];
+	else
+		read_disk_block(disk, dirNum, (void*)&dir);
+}
+
+//this function writes a directory block, keeping the index in step
+void writeDir(int disk, short dirNum, dirblock_t &dir)
+{
+	write_disk_block(disk, dirNum, (void*)&dir);
+	if(indexMeta)
+		indexDir(dirNum, dir);
+}
+
+//this function writes an iNode block, keeping the index in step
+void writeInode(int disk, short inodeNum, inode_t &inode)
+{
+	write_disk_block(disk, inodeNum, (void*)&inode);
+	if(indexMeta)
+		indexInode(inodeNum, inode);
+}
+
+//this function records a directory and its place as parent of the
+//directories in it. Files can be listed in several directories (snapshots
+//share them), so they have no parent.
+void indexDir(short dirNum, const dirblock_t &dir)
+{
+	if(dirIndex[dirNum] == NULL)
+		dirIndex[dirNum] = new dirblock_t;
+	*dirIndex[dirNum] = dir;
+	metaIndex[dirNum].type = META_DIR;
+	metaIndex[dirNum].size = 0;
+	metaIndex[dirNum].numBlocks = 0;
+
+	for(int i = 0; i < MAX_FILES; i++)
+	{
+		short blockNum = dir.dir_entries[i].block_num;
+		if(blockNum > 0 && blockNum < NUM_BLOCKS)
+			if(metaIndex[blockNum].type != META_FILE)
+				metaIndex[blockNum].parent = dirNum;
+	}
+}
+
+//this function records the size and data block count of an iNode
+void indexInode(short inodeNum, const inode_t &inode)
+{
+	int numBlocks;
+
+	countExtents(inode, numBlocks);
+	metaIndex[inodeNum].type = META_FILE;
+	metaIndex[inodeNum].parent = 0;
+	metaIndex[inodeNum].size = inode.size;
+	metaIndex[inodeNum].numBlocks = numBlocks;
+}
+
+//this function returns the index of a snapshot in the table (-1 if none)
+int findSnap(const dirblock_t &snapBlock, const char *name)
+{
+	for(int i = 0; i < MAX_FILES; i++)
+		if(snapBlock.dir_entries[i].block_num != 0 &&
+			strcmp(name, snapBlock.dir_entries[i].name) == 0)
+			return i;
+	return -1;
+}
+
+//this function allocates count blocks with a single read and write of the
+//superblock. The first run of count free blocks is taken if there is one,
+//otherwise the first count free blocks. Nothing is allocated if there are
+//not enough free blocks.
+bool get_free_run(int disk, int count, short *blocks)
+{
+	struct superblock_t super_block;	// super block - block 0
+	int found = 0;				// blocks found so far
+	int start = 0;				// first block of the current run
+
+	read_disk_block(disk, 0, (void *) &super_block);
+
+	for (int b = 0; b < NUM_BLOCKS && found < count; b++) {
+		if (super_block.bitmap[b / 8] & (1 << (b % 8))) {
+			found = 0;
+			start = b + 1;
+		}
+		else
+			found++;
+	}
+	if (found == count) {
+		for (int i = 0; i < count; i++)
+			blocks[i] = start + i;
+	}
+	else {
+		found = 0;
+		for (int b = 0; b < NUM_BLOCKS && found < count; b++)
+			if (!(super_block.bitmap[b / 8] & (1 << (b % 8))))
+				blocks[found++] = b;
+		if (found < count)
+			return false;
+	}
+
+	for (int i = 0; i < count; i++) {
+		super_block.bitmap[blocks[i] / 8] |= 1 << (blocks[i] % 8);
+		refCount[blocks[i]] = 1;
+	}
+	if (count > 0)
+		write_disk_block(disk, 0, (void *) &super_block);
+	return true;
+}
+
+//this function finds the first run of count free blocks. Nothing is
+//allocated. Returns the first block of the run, or 0 if there is none.
+short find_free_run(int disk, int count)
+{
+	struct superblock_t super_block;	// super block - block 0
+	int found = 0;				// free blocks in the current run
+
+	read_disk_block(disk, 0, (void *) &super_block);
+
+	for (int b = 0; b < NUM_BLOCKS; b++) {
+		if (super_block.bitmap[b / 8] & (1 << (b % 8)))
+			found = 0;
+		else if (++found == count)
+			return b - count + 1;
+	}
+	return 0;
+}
+
+//this function counts the data blocks of an iNode, and returns how many
+//runs of consecutive blocks they make up
+int countExtents(const inode_t &inode, int &numBlocks)
+{
+	int extents = 0;
+
+	numBlocks = 0;
+	while(numBlocks < MAX_BLOCKS && inode.blocks[numBlocks] != 0)
+	{
+		if(numBlocks == 0 || inode.blocks[numBlocks] != inode.blocks[numBlocks - 1] + 1)
+			extents++;
+		numBlocks++;
+	}
+	return extents;
+}
+
+//this function prints the extents of every file under a directory
+void fragDir(int disk, short dirNum, const string &path, int &files, int &fragmented, int &extents)
+{
+	dirblock_t dir;
+	inode_t tempFile;
+
+	readDir(disk, dirNum, dir);
+	for(int i = 0; i < MAX_FILES; i++)
+	{
+		short blockNum = dir.dir_entries[i].block_num;
+		string name;
+		int numBlocks;
+		int fileExtents;
+
+		if(blockNum == 0)
+			continue;
+		name = path + "/" + dir.dir_entries[i].name;
+
+		read_disk_block(disk, blockNum, (void*)&tempFile);
+		if(tempFile.magic == DIR_MAGIC_NUM){
+			fragDir(disk, blockNum, name, files, fragmented, extents);
+			continue;
+		}
+
+		fileExtents = countExtents(tempFile, numBlocks);
+		files++;
+		extents += fileExtents;
+		if(fileExtents > 1)
+			fragmented++;
+
+		cout << name;
+		for(int pad = name.size(); pad < 18; pad++)
+			cout << " ";
+		cout << numBlocks << "       " << fileExtents << endl;
+	}
+}
+
+//this function moves the data blocks of a file into one run of free
+//blocks. Files whose blocks are shared with another file are left alone,
+//as are files that would go over the budget. Returns the blocks moved.
+int defragFile(int disk, short inodeNum, int budget)
+{
+	inode_t tempFile;
+	static char data[MAX_FILE_SIZE];
+	short oldBlocks[MAX_BLOCKS];
+	short newBlocks[MAX_BLOCKS];
+	int numBlocks;
+
+	read_disk_block(disk, inodeNum, (void*)&tempFile);
+	if(countExtents(tempFile, numBlocks) <= 1 || numBlocks > budget)
+		return 0;
+	for(int j = 0; j < numBlocks; j++)
+		if(refCount[tempFile.blocks[j]] > 1)
+			return 0;
+
+	//get_free_run takes the first free run when there is one
+	if(find_free_run(disk, numBlocks) == 0 || !get_free_run(disk, numBlocks, newBlocks))
+		return 0;
+
+	for(int j = 0; j < numBlocks; )
+	{
+		int len = 1;
+		while(j + len < numBlocks && tempFile.blocks[j + len] == tempFile.blocks[j] + len)
+			len++;
+		read_disk_blocks(disk, tempFile.blocks[j], len, data + j * BLOCK_SIZE);
+		j += len;
+	}
+	write_disk_blocks(disk, newBlocks[0], numBlocks, data);
+
+	//switch the file over, then give back the old blocks
+	for(int j = 0; j < numBlocks; j++){
+		oldBlocks[j] = tempFile.blocks[j];
+		tempFile.blocks[j] = newBlocks[j];
+	}
+	writeInode(disk, inodeNum, tempFile);
+
+	for(int j = 0; j < numBlocks; j++)
+	{
+		bool wasHashed = hashed[oldBlocks[j]];
+		releaseBlock(disk, oldBlocks[j]);
+		if(wasHashed)
+			indexBlock(newBlocks[j], hashBlock(*(datablock_t *)(data + j * BLOCK_SIZE)));
+	}
+	return numBlocks;
+}
+
+//this function defragments the files under a directory
+void defragDir(int disk, short dirNum, int &budget, int &moved, int &files)
+{
+	dirblock_t dir;
+
+	readDir(disk, dirNum, dir);
+	for(int i = 0; i < MAX_FILES && budget > 0; i++)
+	{
+		short blockNum = dir.dir_entries[i].block_num;
+		int count;
+
+		if(blockNum == 0)
+			continue;
+		if(isDir(blockNum, disk)){
+			defragDir(disk, blockNum, budget, moved, files);
+			continue;
+		}
+
+		count = defragFile(disk, blockNum, budget);
+		if(count > 0){
+			budget -= count;
+			moved += count;
+			files++;
+		}
+	}
+}
+
+//this function returns the entry a new name can use in dir
+int freeEntry(const dirblock_t &dir, const char *name)
+{
+	int index = -1;
+
+	for(int i = 0; i < MAX_FILES; i++)
+	{
+		if(dir.dir_entries[i].block_num == 0)
+			index = i;
+		else if(strcmp(name, dir.dir_entries[i].name) == 0)
+			return -2;
+	}
+	return index;
+}
+
+//this function makes an empty directory in dirNum for an imported host
+//directory. Returns its block, or 0 after saying why it could not.
+short importDir(int disk, short dirNum, const char *name)
+{
+	dirblock_t dir;
+	dirblock_t newDir;
+	short newBlockNum;
+	int index;
+
+	readDir(disk, dirNum, dir);
+	index = freeEntry(dir, name);
+	if(index == -2){
+		cout << "Directory " << name << " is already created." << endl;
+		return 0;
+	}
+	newBlockNum = (index == -1) ? 0 : get_free_block(disk);
+	if(newBlockNum == 0){
+		cout << "There is no space for the directory " << name << " to be created. " << endl;
+		return 0;
+	}
+
+	newDir = mkdir();
+	writeDir(disk, newBlockNum, newDir);
+	strcpy(dir.dir_entries[index].name, name);
+	dir.dir_entries[index].block_num = newBlockNum;
+	dir.num_entries++;
+	writeDir(disk, dirNum, dir);
+	return newBlockNum;
+}
+
+//this function walks a host directory. Subdirectories are made in the disk
+//right away, so the files found can be listed against their directory.
+void scanHostDir(int disk, const string &hostPath, short dirNum, deque<hostfile_t> &files)
+{
+	DIR *hostDir = opendir(hostPath.c_str());
+	struct dirent *entry;
+	struct stat hostStat;
+
+	if(hostDir == NULL){
+		cout << "Could not open host directory " << hostPath << ": " << strerror(errno) << endl;
+		return;
+	}
+
+	while((entry = readdir(hostDir)) != NULL)
+	{
+		string path = hostPath + "/" + entry->d_name;
+
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		if(strlen(entry->d_name) >= MAX_FNAME_SIZE){
+			cout << "Could not import " << path << ": name is too long" << endl;
+			continue;
+		}
+		if(stat(path.c_str(), &hostStat) != 0)
+			continue;
+
+		if(S_ISDIR(hostStat.st_mode)){
+			short childNum = importDir(disk, dirNum, entry->d_name);
+			if(childNum != 0)
+				scanHostDir(disk, path, childNum, files);
+		}
+		else if(S_ISREG(hostStat.st_mode)){
+			hostfile_t file;
+			file.hostPath = path;
+			file.dirNum = dirNum;
+			strcpy(file.name, entry->d_name);
+			file.error = NULL;
+			file.done = false;
+			files.push_back(file);
+		}
+	}
+	closedir(hostDir);
+}
+
+//this function lays a whole file out in the disk. With -u full blocks that
+//are already on the disk are shared; the rest are allocated together and
+//written a run of consecutive blocks at a time.
+bool writeFileData(int disk, const vector<char> &data, inode_t &inode)
+{
+	int size = data.size();
+	int numBlocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	short newBlocks[MAX_BLOCKS];
+	int newIndex[MAX_BLOCKS];
+	int numNew = 0;
+	static char run[MAX_FILE_SIZE];
+	datablock_t block;
+
+	if(numBlocks == 0)
+		numBlocks = 1;	// every file starts out with one data block
+
+	for(int j = 0; j < numBlocks; j++)
+	{
+		int count = size - j * BLOCK_SIZE;
+		if(count > BLOCK_SIZE)
+			count = BLOCK_SIZE;
+		if(count < 0)
+			count = 0;
+
+		memset(block.data, 0, BLOCK_SIZE);
+		memcpy(block.data, data.data() + j * BLOCK_SIZE, count);
+		inode.blocks[j] = 0;
+		if(dedupBlocks && count == BLOCK_SIZE){
+			inode.blocks[j] = findDup(disk, block, hashBlock(block));
+			if(inode.blocks[j] != 0)
+				refCount[inode.blocks[j]]++;
+		}
+		if(inode.blocks[j] == 0){
+			memcpy(run + numNew * BLOCK_SIZE, block.data, BLOCK_SIZE);
+			newIndex[numNew++] = j;
+		}
+	}
+
+	if(!get_free_run(disk, numNew, newBlocks)){
+		for(int j = 0; j < numBlocks; j++)
+			if(inode.blocks[j] != 0)
+				releaseBlock(disk, inode.blocks[j]);
+		return false;
+	}
+
+	for(int k = 0; k < numNew; )
+	{
+		int len = 1;
+		while(k + len < numNew && newBlocks[k + len] == newBlocks[k] + len)
+			len++;
+		write_disk_blocks(disk, newBlocks[k], len, run + k * BLOCK_SIZE);
+		k += len;
+	}
+	for(int k = 0; k < numNew; k++)
+	{
+		inode.blocks[newIndex[k]] = newBlocks[k];
+		if(dedupBlocks && (newIndex[k] + 1) * BLOCK_SIZE <= size)
+			indexBlock(newBlocks[k], hashBlock(*(datablock_t *)(run + k * BLOCK_SIZE)));
+	}
+	inode.size = size;
+	return true;
+}
+
+//this function reads every data block of an iNode, a run of consecutive
+//blocks at a time, and trims the result to the size of the file
+void readFileData(int disk, const inode_t &inode, vector<char> &data)
+{
+	int numBlocks = 0;
+
+	while(numBlocks < MAX_BLOCKS && inode.blocks[numBlocks] != 0)
+		numBlocks++;
+	data.resize(numBlocks * BLOCK_SIZE);
+
+	for(int j = 0; j < numBlocks; )
+	{
+		int len = 1;
+		while(j + len < numBlocks && inode.blocks[j + len] == inode.blocks[j] + len)
+			len++;
+		read_disk_blocks(disk, inode.blocks[j], len, &data[0] + j * BLOCK_SIZE);
+		j += len;
+	}
+	if(inode.size < data.size())
+		data.resize(inode.size);
+}
+
+//this function walks a directory in the disk. Host directories are made
+//right away, and each file is read and handed to the workers as it is
+//found, so they write it out while the walk goes on.
+void scanImageDir(int disk, short dirNum, const string &hostPath, deque<hostfile_t> &files, hostpool_t &pool)
+{
+	dirblock_t dir;
+	inode_t tempFile;
+
+	readDir(disk, dirNum, dir);
+	for(int i = 0; i < MAX_FILES; i++)
+	{
+		short blockNum = dir.dir_entries[i].block_num;
+		string path;
+
+		if(blockNum == 0)
+			continue;
+		path = hostPath + "/" + dir.dir_entries[i].name;
+
+		if(isDir(blockNum, disk)){
+			if(mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+				cout << "Could not create host directory " << path << ": " << strerror(errno) << endl;
+			else
+				scanImageDir(disk, blockNum, path, files, pool);
+		}
+		else{
+			hostfile_t file;
+			file.hostPath = path;
+			file.dirNum = dirNum;
+			strcpy(file.name, dir.dir_entries[i].name);
+			file.error = NULL;
+			file.done = false;
+			read_disk_block(disk, blockNum, (void*)&tempFile);
+			readFileData(disk, tempFile, file.data);
+			addHostFile(files, pool, file);
+		}
+	}
+}
+
+//this function reads a host file in HOST_CHUNK_SIZE pieces. Returns NULL
+//or the reason it failed.
+const char *readHostFile(const string &hostPath, vector<char> &data, char *errorBuf)
+{
+	int fd = open(hostPath.c_str(), O_RDONLY);
+	ssize_t size;
+
+	if(fd == -1)
+		return hostError(errno, errorBuf);
+
+	data.clear();
+	do{
+		size_t used = data.size();
+		data.resize(used + HOST_CHUNK_SIZE);
+		size = read(fd, &data[0] + used, HOST_CHUNK_SIZE);
+		data.resize(used + (size > 0 ? size : 0));
+	}while(size > 0 && data.size() <= (size_t) MAX_FILE_SIZE);
+	close(fd);
+
+	if(size < 0)
+		return "read failed";
+	if(data.size() > (size_t) MAX_FILE_SIZE)
+		return "file is too big";
+	return NULL;
+}
+
+//this function writes a whole host file. Returns NULL or the reason it
+//failed.
+const char *writeHostFile(const string &hostPath, const vector<char> &data, char *errorBuf)
+{
+	int fd = open(hostPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	size_t done = 0;
+
+	if(fd == -1)
+		return hostError(errno, errorBuf);
+
+	while(done < data.size())
+	{
+		ssize_t size = write(fd, &data[0] + done, data.size() - done);
+		if(size <= 0){
+			close(fd);
+			return "write failed";
+		}
+		done += size;
+	}
+	close(fd);
+	return NULL;
+}
+
+//this function puts the text of error number err in errorBuf (which holds
+//ERROR_BUF_SIZE characters) and returns it. Unlike strerror() this is
+//safe in the worker threads.
+const char *hostError(int err, char *errorBuf)
+{
+	const char *text = strerror_r(err, errorBuf, ERROR_BUF_SIZE);
+
+	if(text != errorBuf){
+		strncpy(errorBuf, text, ERROR_BUF_SIZE - 1);
+		errorBuf[ERROR_BUF_SIZE - 1] = 0;
+	}
+	return errorBuf;
+}
+
+//this function adds a file to the end of the list and wakes a worker
+void addHostFile(deque<hostfile_t> &files, hostpool_t &pool, const hostfile_t &file)
+{
+	{
+		lock_guard<mutex> guard(pool.lock);
+		files.push_back(file);
+	}
+	pool.added.notify_one();
+}
+
+//this function takes host files off the list until there are none left
+//and no more are being added
+void hostWorker(deque<hostfile_t> *files, hostpool_t *pool, bool reading)
+{
+	while(true)
+	{
+		hostfile_t *file;
+		const char *error;
+
+		{
+			unique_lock<mutex> guard(pool->lock);
+			while(pool->next >= files->size() && pool->adding)
+				pool->added.wait(guard);
+			if(pool->next >= files->size())
+				return;
+			file = &(*files)[pool->next++];
+		}
+
+		if(reading)
+			error = readHostFile(file->hostPath, file->data, file->errorBuf);
+		else
+			error = writeHostFile(file->hostPath, file->data, file->errorBuf);
+
+		{
+			lock_guard<mutex> guard(pool->lock);
+			file->error = error;
+			file->done = true;
+		}
+		pool->finished.notify_all();
+	}
+}
+
+//this function starts up to MAX_WORKERS threads on a list of host files.
+//Unless pool.adding is set, the list must not change until the workers are
+//joined; if it is, files are added with addHostFile() and pool.adding is
+//cleared (under the lock, waking every worker) once the list is complete.
+void startWorkers(deque<hostfile_t> &files, hostpool_t &pool, bool reading, vector<thread> &workers)
+{
+	size_t numWorkers = thread::hardware_concurrency();
+
+	if(numWorkers == 0)
+		numWorkers = 1;
+	if(numWorkers > (size_t) MAX_WORKERS)
+		numWorkers = MAX_WORKERS;
+	if(!pool.adding && numWorkers > files.size())
+		numWorkers = files.size();
+
+	pool.next = 0;
+	for(size_t i = 0; i < numWorkers; i++)
+		workers.push_back(thread(hostWorker, &files, &pool, reading));
+}
+
+bool make_cmd(char *cmd_str, struct cmd_t &command)
+{
+	const char *DELIM  = " \t\n"; // delimiters
+	int numtokens = 0;		// number of tokens
+	const char *snew;		// command string without leading spaces
+	char *temp_str;		// temporary string used by strtok
+
+	// Remove spaces at beginning
+	snew = cmd_str + strspn(cmd_str, DELIM);
+	if (strlen(snew) == 0) {
+		cerr << "Empty command line" << endl;
+		return false;
+	}
+
+	// Create new string
+	temp_str = (char *) new char[strlen(snew) + 1];
+	if (temp_str == NULL) {
+		cerr << "new failed" << endl; 
+		exit(-1);
+	}
+	strcpy(temp_str, snew);
+
+	// Count the number of tokens in the command */
+	if (strtok(temp_str, DELIM) != NULL)
+		for (numtokens = 1; strtok(NULL, DELIM) != NULL; numtokens++) ; 
+
+	// Check for empty command line
+	if (numtokens == 0) {
+		cerr << "Empty command line" << endl;
+		delete [] temp_str;
+		return false;
+	}
+
+	// Extract the data
+	strcpy(temp_str, snew);
+	command.cmd_name = strtok(temp_str, DELIM);
+	command.file_name = NULL;
+	command.data = NULL;
+	if (numtokens > 1) command.file_name = strtok(NULL, DELIM);
+	if (numtokens > 2) command.data = strtok(NULL, DELIM);
+
+	// Check for invalid command lines
+	if (strcmp(command.cmd_name, "ls") == 0 ||
+		strcmp(command.cmd_name, "home") == 0 ||
+		strcmp(command.cmd_name, "space") == 0 ||
+		strcmp(command.cmd_name, "snaps") == 0 ||
+		strcmp(command.cmd_name, "frag") == 0 ||
+		strcmp(command.cmd_name, "quit") == 0)
+	{
+		if (numtokens != 1) {
+			cerr << "Invalid command line: " << command.cmd_name;
+			cerr << " has improper number of arguments" << endl;
+			delete [] temp_str;
+			return false;
+		}
+	}
+	else if (strcmp(command.cmd_name, "mkdir") == 0 ||
+		strcmp(command.cmd_name, "cd") == 0 ||
+		strcmp(command.cmd_name, "rmdir") == 0 ||
+		strcmp(command.cmd_name, "create") == 0||
+		strcmp(command.cmd_name, "cat") == 0 ||
+		strcmp(command.cmd_name, "rm") == 0 ||
+		strcmp(command.cmd_name, "stat") == 0 ||
+		strcmp(command.cmd_name, "snap") == 0 ||
+		strcmp(command.cmd_name, "rollback") == 0 ||
+		strcmp(command.cmd_name, "rmsnap") == 0)
+	{
+		if (numtokens != 2) {
 			cerr << "Invalid command line: " << command.cmd_name;
 			cerr << " has improper number of arguments" << endl;
+			delete [] temp_str;
 			return false;
 		}
 		if (strlen(command.file_name) >= MAX_FNAME_SIZE) {
 			cerr << "Invalid command line: " << command.file_name;
 			cerr << " is too long for a file name" << endl;
+			delete [] temp_str;
 			return false;	
 		}
 	}
+	else if (strcmp(command.cmd_name, "backup-delta") == 0 ||
+		strcmp(command.cmd_name, "backup-apply") == 0)
+	{
+		if (numtokens != 2) {
+			cerr << "Invalid command line: " << command.cmd_name;
+			cerr << " has improper number of arguments" << endl;
+			delete [] temp_str;
+			return false;
+		}
+	}
 	else if (strcmp(command.cmd_name, "append") == 0)
 	{
 		if (numtokens != 3) {
 			cerr << "Invalid command line: " << command.cmd_name;
 			cerr << " has improper number of arguments" << endl;
+			delete [] temp_str;
+			return false;
+		}
+		if (strlen(command.file_name) >= MAX_FNAME_SIZE) {
+			cerr << "Invalid command line: " << command.file_name;
+			cerr << " is too long for a file name" << endl;
+			delete [] temp_str;
+			return false;
+		}
+	}
+	else if (strcmp(command.cmd_name, "defrag") == 0)
+	{
+		if (numtokens > 2) {
+			cerr << "Invalid command line: " << command.cmd_name;
+			cerr << " has improper number of arguments" << endl;
+			delete [] temp_str;
+			return false;
+		}
+		if (numtokens == 2 && atoi(command.file_name) <= 0) {
+			cerr << "Invalid command line: " << command.file_name;
+			cerr << " is not a number of blocks" << endl;
+			delete [] temp_str;
+			return false;
+		}
+	}
+	else if (strcmp(command.cmd_name, "import") == 0)
+	{
+		if (numtokens != 3) {
+			cerr << "Invalid command line: " << command.cmd_name;
+			cerr << " has improper number of arguments" << endl;
+			delete [] temp_str;
+			return false;
+		}
+		if (strlen(command.data) >= MAX_FNAME_SIZE) {
+			cerr << "Invalid command line: " << command.data;
+			cerr << " is too long for a file name" << endl;
+			delete [] temp_str;
+			return false;
+		}
+	}
+	else if (strcmp(command.cmd_name, "export") == 0)
+	{
+		if (numtokens != 3) {
+			cerr << "Invalid command line: " << command.cmd_name;
+			cerr << " has improper number of arguments" << endl;
+			delete [] temp_str;
 			return false;
 		}
 		if (strlen(command.file_name) >= MAX_FNAME_SIZE) {
 			cerr << "Invalid command line: " << command.file_name;
 			cerr << " is too long for a file name" << endl;
+			delete [] temp_str;
+			return false;
+		}
+	}
+	else if (strcmp(command.cmd_name, "cp") == 0 ||
+		strcmp(command.cmd_name, "mv") == 0)
+	{
+		if (numtokens != 3) {
+			cerr << "Invalid command line: " << command.cmd_name;
+			cerr << " has improper number of arguments" << endl;
+			delete [] temp_str;
+			return false;
+		}
+		if (strlen(command.file_name) >= MAX_FNAME_SIZE) {
+			cerr << "Invalid command line: " << command.file_name;
+			cerr << " is too long for a file name" << endl;
+			delete [] temp_str;
+			return false;
+		}
+		if (strlen(command.data) >= MAX_FNAME_SIZE) {
+			cerr << "Invalid command line: " << command.data;
+			cerr << " is too long for a file name" << endl;
+			delete [] temp_str;
 			return false;
 		}
 	}
 	else {
 		cerr << "Invalid command line: " << command.cmd_name;
 		cerr << " is not a command" << endl; 
+		delete [] temp_str;
 		return false;
 	} 
 
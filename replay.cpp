@@ -0,0 +1,234 @@
+// CPSC 341 - HW3:  Disk Trace Replay
+// This replays a trace recorded by "filesys -r" against a disk, as fast as
+// the disk allows, and reports the throughput and latency it got.
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "disk.h"
+
+const int STRIPE_UNIT = 8;
+const int NUM_TYPES = TRACE_WRITE + 1;
+
+// One read or write from the trace
+struct request_t {
+  unsigned char type;		// TRACE_READ or TRACE_WRITE
+  short block;			// first block
+  short count;			// number of blocks
+  int command;			// index of the command that made it
+};
+
+// What replaying one command's requests cost
+struct command_stats_t {
+  string name;			// name of the command
+  int requests;			// requests made for it
+  long long blocks;		// blocks moved for it
+  long long nsec;		// time spent on them
+};
+
+// Reads the trace into requests and the commands they were made for.
+// Returns the number of mounts in the trace.
+int load_trace(const char *file_name, vector<request_t> &requests,
+               vector<command_stats_t> &commands, double &recorded_sec)
+{
+  vector<char> data;
+  ssize_t len;
+  size_t pos = 0;
+  int command = 0;
+  int mounts = 0;
+  int fd = open(file_name, O_RDONLY);
+
+  if (fd == -1) {
+    cerr << "Could not open trace " << file_name << endl;
+    exit(-1);
+  }
+  do {
+    size_t used = data.size();
+    data.resize(used + 65536);
+    len = read(fd, &data[0] + used, 65536);
+    data.resize(used + (len > 0 ? len : 0));
+  } while (len > 0);
+  close(fd);
+
+  // Requests made before the first command (formatting, mounting) are
+  // put down to "mount"
+  command_stats_t mount_stats = { "mount", 0, 0, 0 };
+  commands.clear();
+  commands.push_back(mount_stats);
+  recorded_sec = 0;
+
+  while (pos + sizeof(trace_rec_t) <= data.size()) {
+    trace_rec_t rec;
+    memcpy(&rec, &data[pos], sizeof(rec));
+    pos += sizeof(rec);
+    recorded_sec += rec.delay / 1e6;
+
+    if (rec.type == TRACE_COMMAND) {
+      if (rec.count < 0 || pos + rec.count > data.size()) break;
+      string name(&data[pos], rec.count);
+      pos += rec.count;
+
+      for (command = 0; command < (int) commands.size(); command++)
+        if (commands[command].name == name) break;
+      if (command == (int) commands.size()) {
+        command_stats_t stats = { name, 0, 0, 0 };
+        commands.push_back(stats);
+      }
+    }
+    else if (rec.type == TRACE_READ || rec.type == TRACE_WRITE) {
+      if (rec.block < 0 || rec.count < 0 || rec.block + rec.count > NUM_BLOCKS) {
+        cerr << "Trace has a request outside the disk" << endl;
+        exit(-1);
+      }
+      request_t req = { rec.type, rec.block, rec.count, command };
+      requests.push_back(req);
+    }
+    else if (rec.type == TRACE_MOUNT)
+      mounts++;
+    else if (rec.type != TRACE_UNMOUNT) {
+      cerr << "Trace is damaged" << endl;
+      exit(-1);
+    }
+  }
+  if (pos != data.size())
+    cerr << "Ignoring a partial record at the end of the trace" << endl;
+  return mounts;
+}
+
+// Returns the p'th percentile of sorted latencies, in microseconds
+double percentile(const vector<long long> &sorted, double p)
+{
+  if (sorted.empty()) return 0;
+  size_t i = (size_t) (p / 100 * (sorted.size() - 1) + 0.5);
+  return sorted[i] / 1e3;
+}
+
+// Prints a line of latency figures for one type of request
+void report_latency(const char *label, vector<long long> &nsec)
+{
+  long long total = 0;
+
+  sort(nsec.begin(), nsec.end());
+  for (size_t i = 0; i < nsec.size(); i++)
+    total += nsec[i];
+  cout << left << setw(8) << label << right << setw(10) << nsec.size()
+       << fixed << setprecision(2)
+       << setw(10) << (nsec.empty() ? 0 : total / 1e3 / nsec.size())
+       << setw(10) << percentile(nsec, 50)
+       << setw(10) << percentile(nsec, 99)
+       << setw(10) << (nsec.empty() ? 0 : nsec.back() / 1e3) << endl;
+}
+
+int main(int argc, char *argv[])
+{
+  int stripe_unit = STRIPE_UNIT;  // blocks per member when striped (-t)
+  int repeat = 1;		  // times to replay the trace (-n)
+  bool cached = false;		  // keep the disk in memory (-c)
+  int opt;			  // command line option
+  vector<request_t> requests;
+  vector<command_stats_t> commands;
+  vector<long long> latency[NUM_TYPES];
+  double recorded_sec;
+  long long blocks = 0;
+  struct timespec start, end;
+  int mounts;
+  int disk;
+
+  while ((opt = getopt(argc, argv, "cn:t:")) != -1) {
+    if (opt == 'c')
+      cached = true;
+    else if (opt == 'n' && atoi(optarg) > 0)
+      repeat = atoi(optarg);
+    else if (opt == 't' && atoi(optarg) > 0)
+      stripe_unit = atoi(optarg);
+    else
+      optind = argc;
+  }
+  if (argc - optind < 2 || argc - optind - 1 > MAX_MEMBERS) {
+    cerr << "Usage: " << argv[0]
+         << " [-c] [-n repeat] [-t stripe_unit] trace_file disk_file ..." << endl;
+    cerr << "The disk is overwritten by the writes in the trace." << endl;
+    exit(-1);
+  }
+
+  mounts = load_trace(argv[optind], requests, commands, recorded_sec);
+
+  // Any disk will do; a new one is filled with zeroes so it can be read
+  if (mount_striped_disk((const char **) argv + optind + 1, argc - optind - 1,
+                         stripe_unit, &disk)) {
+    vector<char> zero((size_t) NUM_BLOCKS * BLOCK_SIZE, 0);
+    write_disk_blocks(disk, 0, NUM_BLOCKS, &zero[0]);
+  }
+  if (cached)
+    cache_disk(disk);
+
+  // Writes store the block number in every byte of the block
+  vector<char> buf((size_t) NUM_BLOCKS * BLOCK_SIZE);
+  for (int b = 0; b < NUM_BLOCKS; b++)
+    memset(&buf[(size_t) b * BLOCK_SIZE], b, BLOCK_SIZE);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int r = 0; r < repeat; r++) {
+    for (size_t i = 0; i < requests.size(); i++) {
+      const request_t &req = requests[i];
+      char *blocks_buf = &buf[(size_t) req.block * BLOCK_SIZE];
+      struct timespec before, after;
+      long long nsec;
+
+      clock_gettime(CLOCK_MONOTONIC, &before);
+      if (req.type == TRACE_READ)
+        read_disk_blocks(disk, req.block, req.count, blocks_buf);
+      else
+        write_disk_blocks(disk, req.block, req.count, blocks_buf);
+      clock_gettime(CLOCK_MONOTONIC, &after);
+
+      nsec = (after.tv_sec - before.tv_sec) * 1000000000LL +
+        (after.tv_nsec - before.tv_nsec);
+      latency[req.type].push_back(nsec);
+      commands[req.command].requests++;
+      commands[req.command].blocks += req.count;
+      commands[req.command].nsec += nsec;
+      blocks += req.count;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  unmount_disk(disk);
+
+  double sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  size_t total = requests.size() * repeat;
+
+  cout << "Trace: " << requests.size() << " requests from " << mounts
+       << " mount(s), " << fixed << setprecision(3) << recorded_sec
+       << " s when recorded" << endl;
+  cout << "Replayed " << total << " requests (" << blocks << " blocks) in "
+       << sec << " s" << endl;
+  cout << setprecision(0) << (sec > 0 ? total / sec : 0) << " requests/s, "
+       << setprecision(2) << (sec > 0 ? blocks * BLOCK_SIZE / sec / 1e6 : 0)
+       << " MB/s" << endl << endl;
+
+  cout << left << setw(8) << "Type" << right << setw(10) << "Requests"
+       << setw(10) << "Mean us" << setw(10) << "p50 us" << setw(10) << "p99 us"
+       << setw(10) << "Max us" << endl;
+  report_latency("read", latency[TRACE_READ]);
+  report_latency("write", latency[TRACE_WRITE]);
+  cout << endl;
+
+  cout << left << setw(14) << "Command" << right << setw(10) << "Requests"
+       << setw(10) << "Blocks" << setw(10) << "Time ms" << endl;
+  for (size_t c = 0; c < commands.size(); c++) {
+    if (commands[c].requests == 0) continue;
+    cout << left << setw(14) << commands[c].name << right
+         << setw(10) << commands[c].requests << setw(10) << commands[c].blocks
+         << setw(10) << setprecision(3) << commands[c].nsec / 1e6 << endl;
+  }
+  return 0;
+}